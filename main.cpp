@@ -1,15 +1,221 @@
-//g++ main.cpp -lSDL2 -lSDL2_image -lSDL2_ttf && ./a.out
+//g++ main.cpp -pthread -lSDL2 -lSDL2_image -lSDL2_ttf && ./a.out
 
 //Using SDL, SDL_image, standard IO, vectors, and strings
 #include <SDL2/SDL.h>
 #include <SDL2/SDL_image.h>
 #include <bits/stdc++.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#endif
 using namespace std;
 
 //Screen dimension constants
 const int SCREEN_WIDTH = 1578;
 const int SCREEN_HEIGHT = 878;
 
+//Default simulation tick rate, independent of the display refresh rate; speeds are tuned per tick at this rate
+const int TICKS_PER_SECOND = 60;
+
+//Most ticks we will catch up on before rendering a frame
+const int MAX_TICKS_PER_FRAME = 5;
+
+//Longest the main thread sleeps on an idle screen before checking again, the simulation wakes it sooner when something changes
+const int IDLE_WAIT_MS = 100;
+
+//Entities each job of a parallel pass takes
+const int ENTITY_JOB_GRAIN = 4096;
+
+//Most particles alive at once, the pool never grows past it
+const int PARTICLE_CAPACITY = 1 << 18;
+
+//Particles each integration job takes
+const int PARTICLE_JOB_GRAIN = 16384;
+
+//Downward pull on particles in pixels per second squared
+const float PARTICLE_GRAVITY = 400;
+
+//Zone events each thread's profiler ring holds, oldest are overwritten, a few hundred frames of the main thread
+const int PROFILER_RING_SIZE = 1 << 12;
+
+//Most distinct profiler zones
+const int PROFILER_MAX_ZONES = 64;
+
+//16 bit formats compact texture storage picks from, for opaque and for color keyed content, in order of preference
+const Uint32 COMPACT_OPAQUE_FORMATS[] = { SDL_PIXELFORMAT_RGB565, SDL_PIXELFORMAT_BGR565 };
+const Uint32 COMPACT_KEYED_FORMATS[] = { SDL_PIXELFORMAT_ARGB4444, SDL_PIXELFORMAT_RGBA4444, SDL_PIXELFORMAT_ABGR4444, SDL_PIXELFORMAT_BGRA4444 };
+
+//Pixel format asset packs store, and what images are converted to when the renderer has no preference
+const Uint32 LOADED_PIXEL_FORMAT = SDL_PIXELFORMAT_ARGB8888;
+
+//Precompiled asset pack, rebuild it with --pack after changing any image
+const char* ASSET_PACK_PATH = "assets.pak";
+
+//Records scoped timings into per-thread rings, summarizes them and dumps them as Chrome trace JSON
+class Profiler
+{
+	public:
+		//Gets the id of a named zone, registering it on first use
+		static int zone( const char* name );
+
+		//Records one finished zone on the calling thread without locking
+		static void record( int zone, Uint64 start, Uint64 end );
+
+		//Prints min, average and p99 milliseconds per zone over the buffered events
+		static void printSummary();
+
+		//Writes the buffered events of every thread as Chrome trace JSON
+		static bool writeTrace( std::string path );
+
+	private:
+		//One finished zone
+		struct Event
+		{
+			Uint64 start;
+			Uint64 end;
+			int zone;
+		};
+
+		//A ring entry, sequence is the event's index plus one once it is fully written and 0 while it is being written
+		struct Slot
+		{
+			std::atomic<Uint64> sequence;
+			std::atomic<Uint64> start;
+			std::atomic<Uint64> end;
+			std::atomic<int> zone;
+		};
+
+		//Single writer ring, only the thread holding it advances head
+		struct Ring
+		{
+			int thread;
+			std::atomic<Uint64> head;
+			Slot slots[ PROFILER_RING_SIZE ];
+		};
+
+		//Gets the calling thread's ring, reusing one a finished thread gave back or creating it on first use
+		static Ring* threadRing();
+
+		//Hands a ring back when its thread exits, its events stay readable until the next thread overwrites them
+		static void releaseRing( Ring* ring );
+
+		//Copies the events of a ring, skipping any the writer was overwriting while they were read
+		static void snapshot( Ring* ring, std::vector<Event>& events );
+
+		//Zone names, every ring ever created and the ones no thread holds, guarded by the mutex
+		static std::mutex sMutex;
+		static std::vector<std::string> sZones;
+		static std::vector<std::unique_ptr<Ring>> sRings;
+		static std::vector<Ring*> sFreeRings;
+};
+
+//Times the enclosing scope as one profiler zone
+class ProfileScope
+{
+	public:
+		//Starts timing
+		ProfileScope( int zone );
+
+		//Records the zone
+		~ProfileScope();
+
+	private:
+		int mZone;
+		Uint64 mStart;
+};
+
+//Times the rest of the enclosing scope under name
+#define PROFILE_CONCAT_INNER( a, b ) a##b
+#define PROFILE_CONCAT( a, b ) PROFILE_CONCAT_INNER( a, b )
+#define PROFILE_SCOPE( name ) static const int PROFILE_CONCAT( profileZone, __LINE__ ) = Profiler::zone( name ); ProfileScope PROFILE_CONCAT( profileScope, __LINE__ )( PROFILE_CONCAT( profileZone, __LINE__ ) )
+
+//Linear allocator for data that lives one frame or tick, freed all at once by reset
+//Several threads may allocate at once, reset only while nothing is allocating
+class FrameArena
+{
+	public:
+		//Allocates the block
+		FrameArena( size_t capacity = 1 << 20 );
+
+		//Frees the block
+		~FrameArena();
+
+		//Gets aligned memory, from the heap once the block is full until the next reset grows the block
+		void* allocate( size_t bytes, size_t alignment );
+
+		//Frees everything at once, O(1) unless the block overflowed
+		void reset();
+
+		//Gets bytes handed out since the last reset and the most ever handed out between resets
+		size_t getUsed();
+		size_t getHighWater();
+
+		//Gets the size of the block
+		size_t getCapacity();
+
+	private:
+		//The block and how much of it is handed out
+		char* mBlock;
+		size_t mCapacity;
+		std::atomic<size_t> mUsed;
+		size_t mHighWater;
+
+		//Heap allocations made after the block filled up
+		std::vector<void*> mOverflow;
+		size_t mOverflowBytes;
+		std::mutex mOverflowMutex;
+};
+
+//Adapter that lets standard containers allocate from a frame arena, deallocation does nothing
+template<typename T>
+class FrameAllocator
+{
+	public:
+		typedef T value_type;
+
+		FrameAllocator( FrameArena* arena ) : mArena( arena ) {}
+
+		template<typename U>
+		FrameAllocator( const FrameAllocator<U>& other ) : mArena( other.getArena() ) {}
+
+		T* allocate( size_t count )
+		{
+			return (T*)mArena->allocate( count * sizeof( T ), alignof( T ) );
+		}
+
+		void deallocate( T* pointer, size_t count )
+		{
+		}
+
+		FrameArena* getArena() const
+		{
+			return mArena;
+		}
+
+		template<typename U>
+		bool operator==( const FrameAllocator<U>& other ) const
+		{
+			return mArena == other.getArena();
+		}
+
+		template<typename U>
+		bool operator!=( const FrameAllocator<U>& other ) const
+		{
+			return mArena != other.getArena();
+		}
+
+	private:
+		FrameArena* mArena;
+};
+
+//Vector that lives in a frame arena
+template<typename T>
+using FrameVector = std::vector<T, FrameAllocator<T>>;
+
 //Texture wrapper class
 class LTexture
 {
@@ -23,6 +229,9 @@ class LTexture
 		//Loads image at specified path
 		bool loadFromFile( std::string path );
 
+		//Creates texture from surface pixels
+		bool loadFromSurface( SDL_Surface* surface );
+
 		#if defined(SDL_TTF_MAJOR_VERSION)
 		//Creates image from font string
 		bool loadFromRenderedText( std::string textureText, SDL_Color textColor );
@@ -42,12 +251,14 @@ class LTexture
 		
 		//Renders texture at given point
 		void render( int x, int y, double angle, SDL_RendererFlip flip, SDL_Rect* clip = NULL,  SDL_Point* center = NULL );
-		void RenderSprite(int x, int y, SDL_Rect* clip);
 
 		//Gets image dimensions
 		int getWidth();
 		int getHeight();
 
+		//Gets the hardware texture
+		SDL_Texture* getTexture();
+
 	private:
 		//The actual hardware texture
 		SDL_Texture* mTexture;
@@ -57,341 +268,4580 @@ class LTexture
 		int mHeight;
 };
 
-//The sprite that will move around on the screen
-class Sprite
+//Queues textured quads and submits them with one geometry call per texture
+class SpriteBatch
 {
-    public:
-		//The dimensions of the sprite
-		static const int sprite_WIDTH = 20;
-		static const int sprite_HEIGHT = 20;
-
-		// //Maximum axis velocity of the sprite
-		static const int sprite_VEL = 5;
+	public:
+		//Queues the clip (or whole texture) at the given point
+		void draw( LTexture& texture, float x, float y, SDL_Rect* clip = NULL, SDL_Color color = { 0xFF, 0xFF, 0xFF, 0xFF } );
 
-		//Initializes the variables
-		Sprite();
+		//Submits every queued quad, textures in order of first use
+		void flush();
 
-		//Takes key presses and adjusts the sprite's velocity
-		void handleEvent( SDL_Event& e );
+		//Number of quads waiting to be flushed
+		int getQuadCount();
 
-		//Moves the sprite
-		void move();
+	private:
+		//The quads queued for one texture
+		struct Bucket
+		{
+			SDL_Texture* texture;
+			std::vector<SDL_Vertex> vertices;
+			std::vector<int> indices;
+		};
 
-		//Shows the sprite on the screen
-		
-	
-    private:
-		//The actual hardware texture
-		SDL_Texture* mTexture;
+		//Buckets are kept between frames so their storage is reused
+		std::vector<Bucket> mBuckets;
 
-		
+		//Number of buckets in use this frame
+		int mActiveBuckets = 0;
 };
 
-//The X and Y offsets of the sprite
-		int sprite_PosX, sprite_PosY;
+//Read-only memory mapped view of a precompiled asset pack
+class AssetPack
+{
+	public:
+		//Initializes variables
+		AssetPack();
+
+		//Unmaps the pack
+		~AssetPack();
 
-		//The velocity of the sprite
-		int sprite_VelX, sprite_VelY;
+		//Maps the pack at path, false if it is missing or was built for another format
+		bool open( std::string path );
 
-//Walking animation
-		const int WALKING_ANIMATION_FRAMES = 4;
-		SDL_Rect gspriteClip[ WALKING_ANIMATION_FRAMES ];
+		//Wraps the named image's pixels in place, NULL if the pack does not hold it
+		//Freeing the surface leaves the mapping alone
+		SDL_Surface* getSurface( std::string name );
 
-class Animal
-{
-    public:
-		//The dimensions of the sprite
-		static const int Animal_WIDTH = 20;
-		static const int Animal_HEIGHT = 20;
+		//Gets the clips stored with the named image
+		std::vector<SDL_Rect> getClips( std::string name );
 
-		//Initializes the variables
-		Animal();
+		//Unmaps the pack
+		void close();
 
-		//Shows the sprite on the screen
-		void render();
+		//Writes a pack holding the surfaces and their clips
+		static bool write( std::string path, std::vector<std::string>& names, std::vector<SDL_Surface*>& surfaces, std::vector<std::vector<SDL_Rect>>& clips );
 
-    private:
-		//The X and Y offsets of the sprite
-		int posAx1, posAx2, posAx3, posAy1, posAy2, posAy3;
+	private:
+		//File layout: header, entry table, clip table, then 64 byte aligned pixel rows
+		struct Header
+		{
+			char magic[ 4 ];
+			Uint32 version;
+			Uint32 pixelFormat;
+			Uint32 entryCount;
+			Uint32 clipCount;
+			Uint32 reserved[ 3 ];
+		};
 
-		// //The velocity of the sprite
-		// int sprite_VelX, sprite_VelY;
+		struct Entry
+		{
+			char name[ 64 ];
+			Uint32 width;
+			Uint32 height;
+			Uint32 pitch;
+			Uint32 firstClip;
+			Uint32 clipCount;
+			Uint32 reserved;
+			Uint64 pixelOffset;
+		};
+
+		//Bumped whenever the layout changes
+		static const Uint32 VERSION = 1;
+
+		//Finds the named entry, NULL if absent
+		const Entry* findEntry( std::string name );
+
+		//The mapping
+		Uint8* mData;
+		size_t mSize;
 };
 
-//Starts up SDL and creates window
-bool init();
+//Decodes images on worker threads, leaving only the texture upload to the render thread
+class AssetLoader
+{
+	public:
+		//Starts the worker threads, one per core when threadCount is 0
+		//Images found in pack are served from it instead of being decoded
+		AssetLoader( AssetPack* pack = NULL, int threadCount = 0 );
 
-//Loads media
-bool loadMedia();
+		//Finishes queued decodes and stops the workers
+		~AssetLoader();
 
-//Frees media and shuts down SDL
-void close();
+		//Queues path for decoding, the future yields the surface or NULL on failure
+		std::shared_future<SDL_Surface*> load( std::string path );
 
-//The window we'll be rendering to
-SDL_Window* gWindow = NULL;
+		//Gets the fraction of queued decodes that have finished
+		float getProgress();
 
-//The window renderer
-SDL_Renderer* gRenderer = NULL;
+	private:
+		//Runs queued decodes until the loader stops
+		void workerLoop();
 
-//Scene textures
-LTexture gSpriteTexture;
-LTexture gBGTexture;
-LTexture gAnimalTexture; 
+		//Precompiled images, may be NULL
+		AssetPack* mPack;
 
-LTexture::LTexture()
-{
-	//Initialize
-	mTexture = NULL;
-	mWidth = 0;
-	mHeight = 0;
-}
+		//Worker threads
+		std::vector<std::thread> mWorkers;
 
-LTexture::~LTexture()
-{
-	//Deallocate
-	free();
-}
+		//Decodes waiting for a worker
+		std::deque<std::packaged_task<SDL_Surface*()>> mQueue;
+		std::mutex mMutex;
+		std::condition_variable mCondition;
+		bool mStopping;
 
-bool LTexture::loadFromFile( std::string path )
+		//Progress counters
+		std::atomic<int> mQueued;
+		std::atomic<int> mFinished;
+};
+
+//Counts unfinished jobs, other jobs can be held back until it reaches zero
+class JobCounter
 {
-	//Get rid of preexisting texture
-	free();
+	public:
+		//Initializes variables
+		JobCounter();
 
-	//The final texture
-	SDL_Texture* newTexture = NULL;
+		//Whether every job counted so far has finished
+		bool isDone();
 
-	//Load image at specified path
-	SDL_Surface* loadedSurface = IMG_Load( path.c_str() );
-	if( loadedSurface == NULL )
-	{
-		printf( "Unable to load image %s! SDL_image Error: %s\n", path.c_str(), IMG_GetError() );
-	}
-	else
-	{
-		//Color key image
-		SDL_SetColorKey( loadedSurface, SDL_TRUE, SDL_MapRGB( loadedSurface->format, 0xFF, 0xFF, 0xFF ) );
+	private:
+		friend class JobSystem;
 
-		//Create texture from surface pixels
-        newTexture = SDL_CreateTextureFromSurface( gRenderer, loadedSurface );
-		if( newTexture == NULL )
+		//Jobs still to finish
+		std::atomic<int> mUnfinished;
+};
+
+//Runs jobs on one thread per core, each with its own deque that idle threads steal from
+//Jobs point at work the caller owns, so queuing never allocates; the work has to outlive the jobs
+class JobSystem
+{
+	public:
+		//Starts the workers, the calling thread counts as one; one thread per core when threadCount is 0
+		JobSystem( int threadCount = 0 );
+
+		//Stops the workers once the queued jobs have run
+		~JobSystem();
+
+		//Queues work() counted by done, held until after reaches zero when given
+		template<typename Work>
+		void run( Work& work, JobCounter* done, JobCounter* after = NULL )
 		{
-			printf( "Unable to create texture from %s! SDL Error: %s\n", path.c_str(), SDL_GetError() );
+			queue( &callWork<Work>, &work, 0, 0, done, after );
 		}
-		else
+
+		//Splits [0, count) into ranges of at most grain and queues work( begin, end ) for each
+		template<typename Work>
+		void parallelFor( int count, int grain, Work& work, JobCounter* done, JobCounter* after = NULL )
 		{
-			//Get image dimensions
-			mWidth = loadedSurface->w;			
-			//mWidth = 100;
-			mHeight = loadedSurface->h;
-			//mHeight = 100;
-			// gSpriteTexture.mHeight = 100;
-			// gSpriteTexture.mWidth = 70;
-			// gAnimalTexture.mHeight = 200;
-			// gAnimalTexture.mWidth = 140;
+			grain = std::max( 1, grain );
+			for( int begin = 0; begin < count; begin += grain )
+			{
+				queue( &callRange<Work>, &work, begin, std::min( count, begin + grain ), done, after );
+			}
 		}
 
-		//Get rid of old loaded surface
-		SDL_FreeSurface( loadedSurface );
-	}
+		//Runs queued jobs on the calling thread until counter reaches zero
+		void wait( JobCounter* counter );
 
-	//Return success
-	mTexture = newTexture;
-	return mTexture != NULL;
-}
+		//Gets the number of threads running jobs, the calling thread included
+		int getThreadCount();
 
-#if defined(SDL_TTF_MAJOR_VERSION)
-bool LTexture::loadFromRenderedText( std::string textureText, SDL_Color textColor )
-{
-	//Get rid of preexisting texture
-	free();
+	private:
+		//A call into the caller's work and the counters around it
+		struct Job
+		{
+			void (*function)( void* work, int begin, int end );
+			void* work;
+			int begin, end;
+			JobCounter* done;
+			JobCounter* after;
+		};
 
-	//Render text surface
-	SDL_Surface* textSurface = TTF_RenderText_Solid( gFont, textureText.c_str(), textColor );
-	if( textSurface != NULL )
-	{
-		//Create texture from surface pixels
-        mTexture = SDL_CreateTextureFromSurface( gRenderer, textSurface );
-		if( mTexture == NULL )
+		//A thread's jobs in a ring, the owner works from the back and thieves take from the front
+		struct Deque
 		{
-			printf( "Unable to create texture from rendered text! SDL Error: %s\n", SDL_GetError() );
+			std::vector<Job> ring;
+			int head = 0;
+			int count = 0;
+			std::mutex mutex;
+		};
+
+		//Trampolines from a job back into the caller's work
+		template<typename Work>
+		static void callWork( void* work, int begin, int end )
+		{
+			( *(Work*)work )();
 		}
-		else
+		template<typename Work>
+		static void callRange( void* work, int begin, int end )
 		{
-			//Get image dimensions
-			mWidth = textSurface->w;
-			mHeight = textSurface->h;
+			( *(Work*)work )( begin, end );
 		}
 
-		//Get rid of old surface
-		SDL_FreeSurface( textSurface );
-	}
-	else
-	{
-		printf( "Unable to render text surface! SDL_ttf Error: %s\n", TTF_GetError() );
-	}
+		//Counts a job and queues it, or holds it until after reaches zero
+		void queue( void (*function)( void*, int, int ), void* work, int begin, int end, JobCounter* done, JobCounter* after );
 
-	
-	//Return success
-	return mTexture != NULL;
-}
-#endif
+		//Queues a job on the calling thread's deque
+		void push( Job& job );
 
-void LTexture::free()
-{
-	//Free texture if it exists
-	if( mTexture != NULL )
-	{
-		SDL_DestroyTexture( mTexture );
-		mTexture = NULL;
-		mWidth = 0;
-		mHeight = 0;
-	}
-}
+		//Runs one job from the given thread's deque or stolen from another, false if there was none
+		bool runOne( int index );
 
-void LTexture::setColor( Uint8 red, Uint8 green, Uint8 blue )
-{
-	//Modulate texture rgb
-	SDL_SetTextureColorMod( mTexture, red, green, blue );
-}
+		//Runs jobs until the system stops
+		void workerLoop( int index );
 
-void LTexture::setBlendMode( SDL_BlendMode blending )
-{
-	//Set blending function
-	SDL_SetTextureBlendMode( mTexture, blending );
-}
-		
-void LTexture::setAlpha( Uint8 alpha )
-{
-	//Modulate texture alpha
-	SDL_SetTextureAlphaMod( mTexture, alpha );
-}
+		//Deque of each thread, the first belongs to every thread outside the system
+		std::vector<std::unique_ptr<Deque>> mDeques;
 
-void LTexture::render( int x, int y, double angle, SDL_RendererFlip flip, SDL_Rect* clip, SDL_Point* center)
-{
-	//Set rendering space and render to screen
-	SDL_Rect renderQuad = { x, y, mWidth, mHeight };
+		//Worker threads
+		std::vector<std::thread> mWorkers;
 
-	//Set clip rendering dimensions
-	if( clip != NULL )
-	{
-		renderQuad.w = clip->w;
-		renderQuad.h = clip->h;
-	}
+		//Jobs sitting in a deque
+		std::atomic<int> mQueued;
 
-	//Render to screen
-	SDL_RenderCopyEx( gRenderer, mTexture, clip, &renderQuad, angle, center, flip ); //this is just like SDL_RenderCopy with some additional stuff
-}
+		//Jobs waiting for their after counter to reach zero
+		std::vector<Job> mHeld;
+		std::mutex mHeldMutex;
 
-int LTexture::getWidth()
-{
-	return mWidth;
-}
+		//Where idle workers sleep
+		std::mutex mSleepMutex;
+		std::condition_variable mWake;
+		bool mStopping;
 
-int LTexture::getHeight()
-{	
-	return mHeight;
-}
+		//Deque of the current thread
+		static thread_local int sThreadIndex;
+};
+
+//Shared handle to a cached texture, the texture is freed with its last handle
+typedef std::shared_ptr<LTexture> TextureHandle;
 
-Sprite::Sprite()
+//Shared handle to cached decoded pixels, the surface is freed with its last handle
+typedef std::shared_ptr<SDL_Surface> ImageHandle;
+
+//Loads each image path once and shares the decoded pixels and the texture between their users
+class TextureCache
 {
-    //Initialize the offsets
-    sprite_PosX = 0;
-    sprite_PosY = SCREEN_HEIGHT/2;
+	public:
+		//Gets the texture for path, loading it on first use; empty handle on failure
+		TextureHandle acquire( std::string path );
 
-    // //Initialize the velocity
-    // sprite_Vel = 0;
-    // sprite_VelY = 0;
-}
+		//Gets the texture for path, uploading the already decoded surface on first use
+		TextureHandle acquire( std::string path, SDL_Surface* decoded );
 
-//Set rendering space and render to screen
-	SDL_Rect SpriteQuad = { 0, 579, 112, 166 };
+		//Gets the decoded pixels for path, decoding them on first use; empty handle on failure
+		ImageHandle acquireImage( std::string path );
 
-void LTexture :: RenderSprite(int x, int y, SDL_Rect* clip)
-{
-    //Set clip rendering dimensions
+		//Gets the decoded pixels for path, taking ownership of decoded on first use and freeing it when path is already resident
+		ImageHandle acquireImage( std::string path, SDL_Surface* decoded );
+
+		//Gets the number of textures currently resident
+		int getResidentCount();
+
+		//Gets the number of decoded images currently resident
+		int getImageCount();
+
+	private:
+		//Gets the resident texture for path, empty handle if there is none
+		TextureHandle find( std::string path );
+
+		//Hands out the first handle to a freshly loaded texture
+		TextureHandle share( std::string path, LTexture* loaded );
+
+		//Drops the entry for path and frees the texture, called by the last handle
+		void release( std::string path, LTexture* texture );
+
+		//Drops the image entry for path and frees the surface, called by the last handle
+		void releaseImage( std::string path, SDL_Surface* surface );
+
+		//Live textures and images by path, expired entries are erased on release
+		std::map<std::string, std::weak_ptr<LTexture>> mEntries;
+		std::map<std::string, std::weak_ptr<SDL_Surface>> mImages;
+};
+
+//Backdrop split into fixed size tiles, only the ones near the view are kept on the GPU
+class TiledBackground
+{
+	public:
+		//Initializes variables
+		TiledBackground();
+
+		//Deallocates memory
+		~TiledBackground();
+
+		//Splits source into tiles, the background holds on to source or a copy converted for storage
+		bool load( ImageHandle source, int tileSize = 256 );
+
+		//Draws the backdrop repeated horizontally from offsetX, uploading and evicting tiles as the view needs
+		void render( int offsetX, int offsetY, SDL_Rect& view );
+
+		//Deallocates tiles and the source pixels
+		void free();
+
+		//Deallocates the tiles but keeps the source pixels, for when the whole backdrop is cached elsewhere
+		void unloadTiles();
+
+		//Gets image dimensions
+		int getWidth();
+		int getHeight();
+
+		//Gets the number of tiles currently on the GPU
+		int getResidentCount();
+
+		//Gets a number that changes whenever the backdrop image does
+		Uint32 getVersion();
+
+		//Gets the pixel format the backdrop is stored in
+		Uint32 getFormat();
+
+		//Gets whether every pixel of the backdrop is fully opaque
+		bool isOpaque();
+
+	private:
+		//A tile and the frame it was last needed in
+		struct Tile
+		{
+			SDL_Texture* texture;
+			Uint32 lastUsed;
+		};
+
+		//Uploads a tile straight from the source rows
+		SDL_Texture* uploadTile( int column, int row );
+
+		//CPU side pixels the tiles stream from
+		ImageHandle mSource;
+
+		//Tile grid
+		int mTileSize;
+		int mColumns;
+		int mRows;
+		std::vector<Tile> mTiles;
+
+		//Frames rendered, used to spot tiles that fell out of view
+		Uint32 mFrame;
+		int mResident;
+
+		//Bumped on every load and free
+		Uint32 mVersion;
+
+		//No pixel has any transparency
+		bool mOpaque;
+};
+
+//Content drawn once into a target texture and composited with a copy until its inputs change
+class RenderLayer
+{
+	public:
+		//Initializes variables
+		RenderLayer();
+
+		//Deallocates memory
+		~RenderLayer();
+
+		//Makes the layer the render target if the content of area at version is not cached yet, returns true when the caller should draw it and then call end
+		//The layer is stored in format, which only needs alpha if the content has some
+		//Opaque content is copied over what is underneath, anything else needs the premultiplied blend mode
+		bool begin( SDL_Rect& area, Uint32 version, Uint32 format, bool opaque );
+
+		//Puts the previous render target back after drawing
+		void end();
+
+		//Draws the cached area offset by x, y and repeated every wrap pixels across the view, 0 for no repeat
+		void render( int x, int y, int wrap, SDL_Rect& view );
+
+		//Gets whether the layer holds content that can be drawn
+		bool isValid();
+
+		//Throws the cached content away so the next begin redraws it, for when the renderer lost its targets
+		void invalidate();
+
+		//Deallocates the target texture
+		void free();
+
+		//Gets the number of times the content was drawn
+		int getRedrawCount();
+
+	private:
+		//The cached pixels
+		SDL_Texture* mTexture;
+
+		//What the pixels show and how they are stored
+		SDL_Rect mArea;
+		Uint32 mVersion;
+		Uint32 mFormat;
+		bool mOpaque;
+		bool mValid;
+
+		//The inputs above could not be cached, not retried until they change
+		bool mFailed;
+
+		//Target to restore when drawing is done
+		SDL_Texture* mPreviousTarget;
+
+		int mRedraws;
+};
+
+//A rectangle of an atlas page that is drawn like its own texture
+struct AtlasRegion
+{
+	//The page the region lives on, shared by every region on it
+	TextureHandle page;
+
+	//Where the region sits on the page
+	SDL_Rect rect;
+};
+
+//Packs sprite images into a few shared textures at load time
+class TextureAtlas
+{
+	public:
+		//Initializes variables, pages are cached as name#0, name#1, ...
+		TextureAtlas( std::string name, int pageWidth = 1024, int pageHeight = 1024 );
+
+		//Deallocates memory
+		~TextureAtlas();
+
+		//Queues the whole image as one region, the atlas holds source until build
+		bool addImage( std::string name, ImageHandle source );
+
+		//Queues each clip of the image as its own frame region, the atlas holds source until build
+		bool addFrames( std::string name, ImageHandle source, SDL_Rect* clips, int count );
+
+		//Packs the queued images and uploads the pages
+		bool build();
+
+		//Gets a packed region, NULL if it was never added
+		AtlasRegion* getRegion( std::string name );
+		AtlasRegion* getRegion( std::string name, int frame );
+
+		//Gets the number of uploaded pages
+		int getPageCount();
+
+		//Deallocates pages and queued images
+		void free();
+
+	private:
+		//An image rectangle waiting to be packed
+		struct Pending
+		{
+			std::string name;
+			SDL_Surface* source;
+			SDL_Rect clip;
+		};
+
+		//One step of a page's skyline
+		struct SkylineNode
+		{
+			int x, y, w;
+		};
+
+		//A page being packed
+		struct Page
+		{
+			int width, height;
+			std::vector<SkylineNode> skyline;
+			SDL_Surface* surface;
+		};
+
+		//Lowest y a w wide rect can rest at starting on skyline node index, -1 if it does not fit
+		int fitSkyline( Page& page, int index, int w, int h );
+
+		//Finds the bottom-left spot for a w by h rect, false if the page is full
+		bool placeRect( Page& page, int w, int h, SDL_Point& position );
+
+		//Cache key prefix of the pages
+		std::string mName;
+
+		//Page dimensions
+		int mPageWidth;
+		int mPageHeight;
+
+		//Decoded source images, held until build
+		std::vector<ImageHandle> mSources;
+
+		//Rectangles waiting for build
+		std::vector<Pending> mPending;
+
+		//Uploaded pages
+		std::vector<TextureHandle> mPages;
+
+		//Packed regions by name
+		std::map<std::string, AtlasRegion> mRegions;
+};
+
+//Handle to an entity, goes stale once the entity is destroyed
+struct EntityHandle
+{
+	Uint32 slot;
+	Uint32 generation;
+};
+
+//What an entity is
+enum EntityFlag
+{
+	ENTITY_PLAYER = 1 << 0,
+	ENTITY_ANIMAL = 1 << 1,
+
+	//Bounces off the screen edges instead of stopping at them
+	ENTITY_REFLECT = 1 << 2,
+
+	//Overlapping the player this tick
+	ENTITY_TOUCHED = 1 << 3
+};
+
+//Sprites entities are drawn with
+enum SpriteId
+{
+	SPRITE_WALK,
+	SPRITE_ANIMAL,
+	SPRITE_COUNT
+};
+
+//Names sprites go by in data files
+const char* SPRITE_NAMES[ SPRITE_COUNT ] = { "walk", "animal" };
+
+//Animation of an entity that shows a fixed frame
+const Uint16 NO_ANIMATION = 0xFFFF;
+
+//Structure of arrays holding every simulated object, entity i sits at index i of each array
+class EntityStore
+{
+	public:
+		//Creates an entity, O(1)
+		EntityHandle create( float x, float y, float w, float h, int sprite, Uint32 flags );
+
+		//Destroys an entity by moving the last one into its place, O(1)
+		void destroy( EntityHandle entity );
+
+		//Gets the array index of entity, -1 once it has been destroyed
+		int indexOf( EntityHandle entity );
+
+		//Gets the number of live entities
+		int getCount();
+
+		//Reserves room for count entities
+		void reserve( int count );
+
+		//Top left corner
+		std::vector<float> posX, posY;
+
+		//Top left corner before the last tick, drawing blends from it
+		std::vector<float> prevX, prevY;
+
+		//Velocity in pixels per tick
+		std::vector<float> velX, velY;
+
+		//Extents used for bounds and overlap tests
+		std::vector<float> width, height;
+
+		//Sprite and frame drawn
+		std::vector<Uint16> sprite, clip;
+
+		//Animation playing and how far into it, NO_ANIMATION for a fixed frame
+		std::vector<Uint16> animation;
+		std::vector<float> animationTime;
+
+		//EntityFlag bits
+		std::vector<Uint32> flags;
+
+	private:
+		//Array index and generation of each handle slot
+		std::vector<Uint32> mSlotIndex;
+		std::vector<Uint32> mSlotGeneration;
+
+		//Handle slot of each array index
+		std::vector<Uint32> mIndexSlot;
+
+		//Slots free for reuse
+		std::vector<Uint32> mFreeSlots;
+};
+
+//Uniform grid hashed into a table sized by entity count, rebuilt every tick
+class SpatialHash
+{
+	public:
+		//Initializes variables
+		SpatialHash( float cellSize = 128 );
+
+		//Rebuilds the grid from every entity's bounds, linear in entity count
+		void build( EntityStore& store );
+
+		//Finds the entities whose bounds overlap box, each once
+		void query( EntityStore& store, const SDL_FRect& box, FrameVector<int>& found );
+
+		//Finds what query would, but only from the grid rows [rowBegin, rowEnd); threads may split the rows between them
+		void queryRows( EntityStore& store, const SDL_FRect& box, int rowBegin, int rowEnd, FrameVector<int>& found );
+
+		//Gets the grid rows box covers as [rowBegin, rowEnd)
+		void getRows( const SDL_FRect& box, int& rowBegin, int& rowEnd );
+
+		//Finds overlapping pairs where first has any of flagsA and second any of flagsB, each pair once
+		void findPairs( EntityStore& store, Uint32 flagsA, Uint32 flagsB, FrameVector<std::pair<int, int>>& pairs );
+
+	private:
+		//Gets the bucket holding cell (x, y)
+		Uint32 bucketOf( int cellX, int cellY );
+
+		//Gets the cell holding a coordinate
+		int cellOf( float coordinate );
+
+		//Width and height of a cell
+		float mCellSize;
+
+		//Bucket count minus one, the count is a power of two
+		Uint32 mBucketMask;
+
+		//Where each bucket's entries start, one past the end for the last
+		std::vector<int> mBucketStart;
+
+		//Fill position of each bucket while building
+		std::vector<int> mBucketNext;
+
+		//Entity index and cell of every entry, grouped by bucket
+		std::vector<int> mEntries;
+		std::vector<int> mEntryCellX;
+		std::vector<int> mEntryCellY;
+};
+
+//A run of sprite frames shown at a fixed rate
+struct AnimationClip
+{
+	std::string name;
+	int sprite;
+	bool loop;
+
+	//Seconds each frame shows for and its inverse
+	float frameTime, frameRate;
+
+	//Seconds for the whole run
+	float duration;
+
+	//Frames in the shared frame table
+	int firstFrame, frameCount;
+};
+
+//Clips shared by every entity, loaded from a text file
+class AnimationStore
+{
+	public:
+		//Loads clips from a text file, frames are checked against gSpriteFrames
+		bool load( std::string path );
+
+		//Gets a clip's id, NO_ANIMATION if there is none by that name
+		Uint16 find( std::string name );
+
+		//Starts an entity on a clip from its first frame
+		void play( EntityStore& store, int index, Uint16 clip );
+
+		//Advances the animated entities in [begin, end) by the given seconds and sets their frames
+		void advance( EntityStore& store, float seconds, int begin, int end );
+
+	private:
+		std::vector<AnimationClip> mClips;
+
+		//Sprite frame of every clip, run after run
+		std::vector<Uint16> mFrames;
+};
+
+//The sprite that will move around on the screen
+class Sprite
+{
+    public:
+		//Maximum axis velocity of the sprite
+		static const int sprite_VEL = 5;
+
+		//Spawns the sprite's entity
+		Sprite( EntityStore& store, float x, float y );
+
+		//Takes key presses and adjusts the sprite's velocity
+		void handleEvent( SDL_Event& e );
+
+		//Gets the sprite's entity
+		EntityHandle getEntity();
+
+    private:
+		//Plays the walk cycle while the sprite moves and holds the standing frame otherwise
+		void updateAnimation( int index );
+
+		//Where the sprite's state lives
+		EntityStore& mStore;
+		EntityHandle mEntity;
+};
+
+//Key events stamped with the simulation tick they were handled before, so runs can be played back exactly
+class InputLog
+{
+	public:
+		//Initializes variables
+		InputLog();
+
+		//Closes the file
+		~InputLog();
+
+		//Starts writing events to a file
+		bool record( std::string path );
+
+		//Loads a recording to play back in place of the keyboard
+		bool replay( std::string path );
+
+		//Appends a key event handled before the given tick when recording
+		void write( SDL_Event& e, Uint32 tick );
+
+		//Takes the next recorded event due before the given tick, the recording ends with an SDL_QUIT
+		bool next( Uint32 tick, SDL_Event& e );
+
+		//Ends a recording at the given tick
+		void close( Uint32 tick );
+
+		//Whether events come from a recording
+		bool isReplaying();
+
+	private:
+		//One event on disk
+		struct Record
+		{
+			Uint32 tick;
+			Uint32 type;
+			Sint32 sym;
+			Uint8 repeat;
+			Uint8 reserved[ 3 ];
+		};
+
+		//Start of the file
+		struct Header
+		{
+			char magic[ 4 ];
+			Uint32 version;
+			Uint32 ticksPerSecond;
+			Uint32 reserved;
+		};
+
+		//Recording being written
+		FILE* mFile;
+
+		//Recording being played back
+		std::vector<Record> mRecords;
+		size_t mNext;
+		bool mReplaying;
+};
+
+//Walking animation
+		const int WALKING_ANIMATION_FRAMES = 4;
+
+//Atlas regions of each sprite's frames
+std::vector<AtlasRegion*> gSpriteFrames[ SPRITE_COUNT ];
+
+//Animation clips
+AnimationStore gAnimations;
+
+//How the frame pacer times presents
+enum PacingPolicy
+{
+	PACING_VSYNC,
+	PACING_CAPPED,
+	PACING_UNCAPPED
+};
+
+//Settings read from the command line
+struct Options
+{
+	//Number of animals in the herd, the first three stand where they always have
+	int herdSize = 3;
+
+	//Frames to run headless on the software renderer before printing a JSON report, 0 to play normally
+	int benchFrames = 0;
+
+	//Threads running simulation jobs, 0 for one per core
+	int threadCount = 0;
+
+	//Simulation ticks per second
+	int tickRate = TICKS_PER_SECOND;
+
+	//Dust particles the player kicks up per second while walking
+	float dustRate = 400;
+
+	//Backdrop scroll in pixels per tick at TICKS_PER_SECOND, 0 holds it still
+	float scrollSpeed = 2;
+
+	//Skip drawing and presenting frames that would look like the one on screen, sleeping on events instead
+	bool idleSkip = false;
+
+	//Premultiply texture alpha at load time and blend accordingly
+	bool premultiplied = false;
+
+	//Store textures in 16 bits when their content allows it
+	bool compactTextures = false;
+
+	//How frames are paced, capped frames aim for targetFps
+	PacingPolicy pacing = PACING_VSYNC;
+	int targetFps = 0;
+
+	//Input recording to write or play back, empty for none
+	std::string recordPath;
+	std::string replayPath;
+};
+
+Options gOptions;
+
+//Scales a speed tuned per tick at TICKS_PER_SECOND to the running tick rate
+float tickScale()
+{
+	return (float)TICKS_PER_SECOND / gOptions.tickRate;
+}
+
+//An image the game loads and the clips cut from it
+struct ImageAsset
+{
+	const char* path;
+	int clipCount;
+	SDL_Rect clips[ WALKING_ANIMATION_FRAMES ];
+};
+
+//Every image, in the order the pack stores them
+enum ImageAssetId
+{
+	IMAGE_SPRITE_SHEET,
+	IMAGE_ANIMAL,
+	IMAGE_CHARACTER,
+	IMAGE_BACKGROUND,
+	IMAGE_ASSET_COUNT
+};
+
+const ImageAsset IMAGE_ASSETS[ IMAGE_ASSET_COUNT ] =
+{
+	{ "shorted_sprite_sheet.png", WALKING_ANIMATION_FRAMES, { { 0, 0, 112, 166 }, { 112, 0, 112, 166 }, { 224, 0, 112, 166 }, { 336, 0, 112, 166 } } },
+	{ "animal.png", 0, {} },
+	{ "character.png", 0, {} },
+	{ "photo.png", 0, {} }
+};
+
+//Loads and color keys the image at specified path
+SDL_Surface* loadSurface( std::string path );
+
+//Converts surface once into the format textures are created in, baking any color key into alpha and premultiplying if asked
+//Returns surface itself when it is already in shape, otherwise a converted copy after freeing surface
+SDL_Surface* normalizeSurface( SDL_Surface* surface );
+
+//Picks the renderer's preferred 32 bit format with alpha for textures
+void chooseTextureFormat();
+
+//How much precision a texture's content needs
+enum TextureStorage
+{
+	//No transparency at all, color fits in 16 bits
+	STORAGE_OPAQUE,
+
+	//Every pixel fully transparent or fully opaque, as color keyed images are
+	STORAGE_KEYED,
+
+	//Soft edges that need all eight bits of alpha
+	STORAGE_FULL
+};
+
+//Looks at every pixel of a normalized surface to see how much precision storing it takes
+TextureStorage analyzeStorage( SDL_Surface* surface );
+
+//Gets the format to store surface's texture in, 16 bit when the content allows it, compact storage is on and the renderer samples that format natively
+Uint32 chooseStorageFormat( SDL_Surface* surface );
+
+//Gets the first of count formats the renderer samples natively, SDL_PIXELFORMAT_UNKNOWN if it takes none of them
+Uint32 findNativeFormat( const Uint32* formats, int count );
+
+//Gets whether compact storage is off, requested but not possible on this renderer, or on
+const char* getCompactStorageState();
+
+//Adds a texture to the memory totals, against what it would take at 32 bits
+void countTextureMemory( SDL_Texture* texture );
+
+//Takes a texture about to be destroyed back out of the memory totals
+void uncountTextureMemory( SDL_Texture* texture );
+
+//Starts up SDL and creates window
+bool init();
+
+//Loads media
+bool loadMedia();
+
+//Decodes every image asset and writes them to a pack at path
+bool writeAssetPack( std::string path );
+
+//Prints the command line options
+void printUsage();
+
+//Reads text as a whole number of times per second, false unless it is all digits from 1 to 1000
+bool parseRate( const char* text, int& rate );
+
+//Spawns count animals
+void spawnHerd( EntityStore& store, int count );
+
+//Moves entities [begin, end) one tick along one axis
+//An entity that would leave [0, limit] stays put, and reverses if it reflects
+typedef void (*MoveAxisKernel)( float* pos, float* vel, const float* extent, const Uint32* flags, int begin, int end, float limit );
+
+//Portable kernel, every vector kernel matches it bit for bit
+void moveAxisScalar( float* pos, float* vel, const float* extent, const Uint32* flags, int begin, int end, float limit );
+
+#if defined(__x86_64__) || defined(__i386__)
+//Four entities per step, baseline on x86-64
+void moveAxisSSE2( float* pos, float* vel, const float* extent, const Uint32* flags, int begin, int end, float limit );
+
+//Eight entities per step, picked at runtime when the CPU has it
+void moveAxisAVX2( float* pos, float* vel, const float* extent, const Uint32* flags, int begin, int end, float limit );
+#endif
+
+//Picks the widest kernel this CPU runs
+MoveAxisKernel selectMoveAxisKernel();
+
+//Runs every vector kernel this CPU has against the scalar one on random and edge case input, false on any difference
+bool testMoveAxisKernels();
+
+//Moves entities [begin, end) one tick, stepping back off the screen edges
+void moveEntities( EntityStore& store, int begin, int end );
+
+//Counts from the last visibility pass
+struct CullStats
+{
+	int visible;
+	int culled;
+};
+
+//Collects the entities overlapping view in draw order, a job per grid row
+CullStats cullEntities( EntityStore& store, SpatialHash& grid, SDL_Rect& view, FrameVector<int>& visible, JobSystem& jobs );
+
+//One sprite to draw, copied out of the simulation so drawing never reads live state
+struct RenderCommand
+{
+	LTexture* texture;
+	SDL_Rect src;
+	SDL_FRect dst;
+
+	//Destination corner before the last tick
+	SDL_FPoint previous;
+
+	SDL_RendererFlip flip;
+	double angle;
+	SDL_Color color;
+};
+
+//One particle to draw, centered on its position
+struct RenderParticle
+{
+	SDL_FPoint position;
+	SDL_FPoint previous;
+	SDL_Color color;
+};
+
+//Everything needed to draw one frame, filled on the simulation thread and drawn on the main thread
+struct RenderList
+{
+	//Starts empty
+	RenderList();
+
+	//Empties the list and its arena for refilling
+	void clear();
+
+	//Holds the commands, particles and whatever else is worked out while filling the list
+	FrameArena arena;
+
+	std::vector<RenderCommand, FrameAllocator<RenderCommand>> commands;
+
+	//Background scroll now and before the last tick, and the view the commands were culled against
+	float scrollingOffset, previousScrollingOffset;
+	SDL_Rect view;
+
+	//Tick the list shows, when in performance counter time it became current and how long ticks are
+	Uint32 tick;
+	Uint64 tickTime;
+	Uint64 tickLength;
+
+	//Particles inside the view, all drawn with one atlas region
+	std::vector<RenderParticle, FrameAllocator<RenderParticle>> particles;
+	AtlasRegion* particleRegion;
+
+	//Counts for the window title and the benchmark report
+	int entityCount;
+	CullStats cullStats;
+
+	//Most the simulation's tick arena has held, copied here since only the simulation thread may touch the arena
+	size_t tickArenaPeak;
+
+	//Tick the content last looked different at, and whether frames between ticks differ because something is in motion
+	Uint32 changedTick;
+	bool moving;
+};
+
+//Triple buffer that hands render lists from one producer thread to one consumer thread without locks
+//Neither side ever waits, the consumer just gets the newest list published
+class RenderListBuffer
+{
+	public:
+		//Initializes variables
+		RenderListBuffer();
+
+		//Gets the list the producer fills
+		RenderList& getWriteList();
+
+		//Hands the filled list over, replacing one the consumer has not taken yet
+		void publish();
+
+		//Takes the newest published list, false if nothing new was published
+		bool acquire();
+
+		//Gets the list the consumer draws
+		RenderList& getReadList();
+
+	private:
+		//Set on the shared index while it holds a list the consumer has not taken
+		static const int FRESH = 4;
+
+		RenderList mLists[ 3 ];
+
+		//Lists owned by each side
+		int mWrite;
+		int mRead;
+
+		//List between the two sides
+		std::atomic<int> mShared;
+};
+
+//Remembers the last frame published to tell whether the next one would look any different
+class DamageTracker
+{
+	public:
+		//Initializes variables
+		DamageTracker();
+
+		//Compares list with the remembered frame, remembering list instead when they differ; returns true when something on screen changed
+		bool update( RenderList& list );
+
+		//Gets whether list has anything that moves between its two ticks
+		static bool isMoving( RenderList& list );
+
+	private:
+		//Gets whether two commands draw the same pixels
+		static bool isSame( const RenderCommand& a, const RenderCommand& b );
+
+		//The remembered frame
+		std::vector<RenderCommand> mCommands;
+		float mScrollingOffset;
+		SDL_Rect mView;
+		bool mHasFrame;
+};
+
+//Times presents by policy and measures the interval between them
+class FramePacer
+{
+	public:
+		//Initializes variables
+		FramePacer();
+
+		//Switches policy, turning the renderer's vsync on only for PACING_VSYNC so frames never wait twice
+		void setPolicy( PacingPolicy policy, int targetFps );
+
+		//Waits until the next capped frame is due, call right before presenting
+		void wait();
+
+		//Records a present, call right after presenting
+		void presented();
+
+		//Gets the mean, standard deviation and worst present to present interval in ms since the last reset
+		double getMeanInterval();
+		double getJitter();
+		double getWorstInterval();
+
+		//Starts a new measurement window
+		void resetStats();
+
+	private:
+		PacingPolicy mPolicy;
+
+		//Counter ticks per capped frame and when the next one is due
+		Uint64 mPeriod;
+		Uint64 mDeadline;
+
+		//How far a 1 ms sleep has been overrunning lately, the wait spins for this much at the end
+		//Jumps up to a bigger overrun straight away and decays a little every frame, never past a period
+		Uint64 mSleepError;
+
+		//Previous present and the interval sums since the last reset
+		Uint64 mLastPresent;
+		int mIntervalCount;
+		double mIntervalSum, mIntervalSquareSum, mWorstInterval;
+};
+
+//Spawns particles around an entity at a steady rate
+struct ParticleEmitter
+{
+	EntityHandle entity;
+
+	//Particles per second, only while the entity moves when movingOnly is set
+	float rate;
+	bool movingOnly;
+
+	//Upward and sideways launch speed in pixels per second, and seconds each particle lives
+	float speed, spread, life;
+
+	//Tint of new particles, fading out over their life
+	SDL_Color color;
+
+	//Part of a particle carried over from earlier ticks
+	float owed;
+};
+
+//Fixed pool of short lived particles stored as structure of arrays, nothing is allocated after construction
+class ParticleSystem
+{
+	public:
+		//Allocates the pool, particles are drawn with region
+		ParticleSystem( AtlasRegion* region, int capacity = PARTICLE_CAPACITY, int maxEmitters = 64 );
+
+		//Attaches an emitter, false once every emitter slot is taken
+		bool addEmitter( ParticleEmitter& emitter );
+
+		//Moves particles [begin, end) and ages them by seconds, ranges may run on separate threads
+		void integrate( int begin, int end, float seconds );
+
+		//Drops expired particles and spawns new ones from the emitters, after every range has integrated
+		void update( EntityStore& store, float seconds );
+
+		//Appends the particles inside view to a render list
+		void render( SDL_Rect& view, RenderList& list );
+
+		//Gets the number of live particles
+		int getCount();
+
+	private:
+		//Region every particle is drawn with
+		AtlasRegion* mRegion;
+
+		//Live particles come first
+		int mCount;
+		int mCapacity;
+
+		//Center and velocity in pixels per second
+		std::vector<float> mPosX, mPosY;
+		std::vector<float> mVelX, mVelY;
+
+		//Seconds left to live and the inverse of the starting life, their product is the opacity
+		std::vector<float> mLife, mFade;
+
+		//Tint of each particle
+		std::vector<SDL_Color> mColor;
+
+		//Length of the last step, to place particles before it when drawing
+		float mLastStep;
+
+		//Attached emitters
+		std::vector<ParticleEmitter> mEmitters;
+		int mMaxEmitters;
+
+		//Seeded so every run sprays the same way
+		std::mt19937 mRandom;
+};
+
+//Appends draw commands for the listed entities, offset by the view
+void renderEntities( EntityStore& store, FrameVector<int>& visible, SDL_Rect& view, RenderList& list );
+
+//Draws the background and every command of the list, alpha of the way from the previous tick to the last
+void drawRenderList( RenderList& list, float alpha );
+
+//Rebuilds the broadphase and flags the animals the player touches
+void updateContacts( EntityStore& store, SpatialHash& grid, FrameVector<std::pair<int, int>>& pairs );
+
+//Draws a small soft white disc for particles to tint
+SDL_Surface* createDustSurface();
+
+//Prints frame time percentiles, throughput and peak memory of a benchmark run as JSON
+void printBenchReport( std::vector<double>& frameTimes, double seconds, RenderList& lastFrame );
+
+//Frees media and shuts down SDL
+void close();
+
+//The window we'll be rendering to
+SDL_Window* gWindow = NULL;
+
+//The window renderer
+SDL_Renderer* gRenderer = NULL;
+
+//Format textures are created in and the blend mode that matches how their alpha is stored
+Uint32 gTextureFormat = LOADED_PIXEL_FORMAT;
+SDL_BlendMode gTextureBlendMode = SDL_BLENDMODE_BLEND;
+
+//Blend mode for premultiplied pixels, and whether the renderer takes it
+SDL_BlendMode gPremultipliedBlendMode = SDL_BLENDMODE_BLEND;
+bool gPremultipliedBlendSupported = false;
+
+//Whether the renderer samples any of the compact storage formats, SDL's stock GPU renderers list none
+bool gCompactStorageSupported = false;
+
+//Conversions done while loading, uploads that still went through SDL's own conversion, and texture memory
+struct TextureLoadStats
+{
+	std::atomic<int> conversions;
+	std::atomic<Uint64> conversionTicks;
+	std::atomic<int> slowUploads;
+	std::atomic<Uint64> storedBytes;
+	std::atomic<Uint64> fullBytes;
+};
+TextureLoadStats gTextureStats = {};
+
+//Precompiled images, mapped while the game runs
+AssetPack gAssetPack;
+
+//Textures and decoded images shared by path
+TextureCache gTextureCache;
+
+//Scene textures
+TiledBackground gBackground;
+
+//The backdrop rows in view, cached so a frame composites it instead of drawing every tile
+RenderLayer gBackgroundLayer;
+
+//Atlas holding the sprite sheet frames and small sprites
+TextureAtlas gSpriteAtlas( "sprites" );
+
+//Batch that collects sprite quads for the current frame
+SpriteBatch gSpriteBatch;
+
+std::mutex Profiler::sMutex;
+std::vector<std::string> Profiler::sZones;
+std::vector<std::unique_ptr<Profiler::Ring>> Profiler::sRings;
+std::vector<Profiler::Ring*> Profiler::sFreeRings;
+
+int Profiler::zone( const char* name )
+{
+	std::lock_guard<std::mutex> lock( sMutex );
+	for( int i = 0; i < (int)sZones.size(); ++i )
+	{
+		if( sZones[ i ] == name )
+		{
+			return i;
+		}
+	}
+
+	//Zones past the limit share the last slot
+	if( (int)sZones.size() == PROFILER_MAX_ZONES )
+	{
+		return PROFILER_MAX_ZONES - 1;
+	}
+	sZones.push_back( name );
+	return (int)sZones.size() - 1;
+}
+
+Profiler::Ring* Profiler::threadRing()
+{
+	//Each thread takes a ring once, after that recording takes no lock
+	//The ring goes back when the thread exits, so loader and worker threads that come and go do not each keep one
+	struct Holder
+	{
+		Ring* ring = NULL;
+		~Holder()
+		{
+			if( ring != NULL )
+			{
+				releaseRing( ring );
+			}
+		}
+	};
+	static thread_local Holder holder;
+	if( holder.ring == NULL )
+	{
+		std::lock_guard<std::mutex> lock( sMutex );
+		if( !sFreeRings.empty() )
+		{
+			holder.ring = sFreeRings.back();
+			sFreeRings.pop_back();
+		}
+		else
+		{
+			sRings.push_back( std::unique_ptr<Ring>( new Ring() ) );
+			holder.ring = sRings.back().get();
+			holder.ring->thread = (int)sRings.size();
+			holder.ring->head = 0;
+		}
+	}
+	return holder.ring;
+}
+
+void Profiler::releaseRing( Ring* ring )
+{
+	std::lock_guard<std::mutex> lock( sMutex );
+	sFreeRings.push_back( ring );
+}
+
+void Profiler::record( int zone, Uint64 start, Uint64 end )
+{
+	Ring* ring = threadRing();
+	Uint64 head = ring->head.load( std::memory_order_relaxed );
+	Slot& slot = ring->slots[ head % PROFILER_RING_SIZE ];
+
+	//Mark the slot as being written before touching it, readers drop what they see in between
+	slot.sequence.store( 0, std::memory_order_relaxed );
+	std::atomic_thread_fence( std::memory_order_release );
+	slot.start.store( start, std::memory_order_relaxed );
+	slot.end.store( end, std::memory_order_relaxed );
+	slot.zone.store( zone, std::memory_order_relaxed );
+
+	//Publish the event to readers
+	slot.sequence.store( head + 1, std::memory_order_release );
+	ring->head.store( head + 1, std::memory_order_release );
+}
+
+void Profiler::snapshot( Ring* ring, std::vector<Event>& events )
+{
+	Uint64 head = ring->head.load( std::memory_order_acquire );
+	Uint64 first = head > PROFILER_RING_SIZE ? head - PROFILER_RING_SIZE : 0;
+	for( Uint64 i = first; i < head; ++i )
+	{
+		//Seqlock read, the slot has to hold event i both before and after copying it
+		Slot& slot = ring->slots[ i % PROFILER_RING_SIZE ];
+		Uint64 before = slot.sequence.load( std::memory_order_acquire );
+		Event event = { slot.start.load( std::memory_order_relaxed ), slot.end.load( std::memory_order_relaxed ), slot.zone.load( std::memory_order_relaxed ) };
+		std::atomic_thread_fence( std::memory_order_acquire );
+		Uint64 after = slot.sequence.load( std::memory_order_relaxed );
+		if( before == i + 1 && after == i + 1 )
+		{
+			events.push_back( event );
+		}
+	}
+}
+
+void Profiler::printSummary()
+{
+	std::lock_guard<std::mutex> lock( sMutex );
+
+	//Durations per zone across every thread
+	std::vector<std::vector<double>> durations( sZones.size() );
+	double toMilliseconds = 1000.0 / SDL_GetPerformanceFrequency();
+	for( int r = 0; r < (int)sRings.size(); ++r )
+	{
+		std::vector<Event> events;
+		snapshot( sRings[ r ].get(), events );
+		for( int i = 0; i < (int)events.size(); ++i )
+		{
+			durations[ events[ i ].zone ].push_back( ( events[ i ].end - events[ i ].start ) * toMilliseconds );
+		}
+	}
+
+	printf( "%-20s %8s %10s %10s %10s\n", "zone", "count", "min ms", "avg ms", "p99 ms" );
+	for( int z = 0; z < (int)sZones.size(); ++z )
+	{
+		std::vector<double>& samples = durations[ z ];
+		if( samples.empty() )
+		{
+			continue;
+		}
+		double total = 0;
+		for( int i = 0; i < (int)samples.size(); ++i )
+		{
+			total += samples[ i ];
+		}
+		size_t p99 = samples.size() * 99 / 100;
+		std::nth_element( samples.begin(), samples.begin() + p99, samples.end() );
+		double p99Value = samples[ p99 ];
+		printf( "%-20s %8d %10.3f %10.3f %10.3f\n", sZones[ z ].c_str(), (int)samples.size(), *std::min_element( samples.begin(), samples.end() ), total / samples.size(), p99Value );
+	}
+}
+
+bool Profiler::writeTrace( std::string path )
+{
+	std::lock_guard<std::mutex> lock( sMutex );
+
+	FILE* file = fopen( path.c_str(), "w" );
+	if( file == NULL )
+	{
+		printf( "Unable to open %s for writing!\n", path.c_str() );
+		return false;
+	}
+
+	//Complete events in microseconds, relative to the earliest one
+	std::vector<std::vector<Event>> events( sRings.size() );
+	Uint64 origin = ~(Uint64)0;
+	for( int r = 0; r < (int)sRings.size(); ++r )
+	{
+		snapshot( sRings[ r ].get(), events[ r ] );
+		for( int i = 0; i < (int)events[ r ].size(); ++i )
+		{
+			origin = std::min( origin, events[ r ][ i ].start );
+		}
+	}
+	double toMicroseconds = 1000000.0 / SDL_GetPerformanceFrequency();
+
+	fprintf( file, "{\"traceEvents\":[\n" );
+	bool first = true;
+	for( int r = 0; r < (int)sRings.size(); ++r )
+	{
+		for( int i = 0; i < (int)events[ r ].size(); ++i )
+		{
+			Event& event = events[ r ][ i ];
+			fprintf( file, "%s{\"name\":\"%s\",\"ph\":\"X\",\"pid\":1,\"tid\":%d,\"ts\":%.3f,\"dur\":%.3f}", first ? "" : ",\n", sZones[ event.zone ].c_str(), sRings[ r ]->thread, ( event.start - origin ) * toMicroseconds, ( event.end - event.start ) * toMicroseconds );
+			first = false;
+		}
+	}
+	fprintf( file, "\n]}\n" );
+
+	bool success = fclose( file ) == 0;
+	if( success )
+	{
+		printf( "Wrote profiler trace to %s\n", path.c_str() );
+	}
+	return success;
+}
+
+ProfileScope::ProfileScope( int zone )
+{
+	mZone = zone;
+	mStart = SDL_GetPerformanceCounter();
+}
+
+ProfileScope::~ProfileScope()
+{
+	Profiler::record( mZone, mStart, SDL_GetPerformanceCounter() );
+}
+
+FrameArena::FrameArena( size_t capacity )
+{
+	//Initialize
+	mCapacity = capacity;
+	mBlock = (char*)malloc( capacity );
+	mUsed = 0;
+	mHighWater = 0;
+	mOverflowBytes = 0;
+	mOverflow.reserve( 64 );
+}
+
+FrameArena::~FrameArena()
+{
+	reset();
+	::free( mBlock );
+}
+
+void* FrameArena::allocate( size_t bytes, size_t alignment )
+{
+	//Claim room for the worst case padding with one atomic add
+	size_t start = mUsed.fetch_add( bytes + alignment - 1 );
+	size_t aligned = ( (size_t)mBlock + start + alignment - 1 ) / alignment * alignment - (size_t)mBlock;
+	if( aligned + bytes <= mCapacity )
+	{
+		return mBlock + aligned;
+	}
+
+	//Full, fall back to the heap until the next reset
+	std::lock_guard<std::mutex> lock( mOverflowMutex );
+	void* memory = ::operator new( bytes + alignment );
+	mOverflow.push_back( memory );
+	mOverflowBytes += bytes + alignment;
+	return (void*)( ( (size_t)memory + alignment - 1 ) / alignment * alignment );
+}
+
+void FrameArena::reset()
+{
+	size_t used = std::min( (size_t)mUsed, mCapacity ) + mOverflowBytes;
+	mHighWater = std::max( mHighWater, used );
+
+	//Outgrew the block, make the next one big enough for this frame so the heap is left alone from then on
+	if( !mOverflow.empty() )
+	{
+		for( int i = 0; i < (int)mOverflow.size(); ++i )
+		{
+			::operator delete( mOverflow[ i ] );
+		}
+		mOverflow.clear();
+		mOverflowBytes = 0;
+
+		mCapacity = std::max( mCapacity * 2, mHighWater + mHighWater / 4 );
+		::free( mBlock );
+		mBlock = (char*)malloc( mCapacity );
+	}
+	mUsed = 0;
+}
+
+size_t FrameArena::getUsed()
+{
+	return std::min( (size_t)mUsed, mCapacity ) + mOverflowBytes;
+}
+
+size_t FrameArena::getHighWater()
+{
+	return std::max( mHighWater, getUsed() );
+}
+
+size_t FrameArena::getCapacity()
+{
+	return mCapacity;
+}
+
+LTexture::LTexture()
+{
+	//Initialize
+	mTexture = NULL;
+	mWidth = 0;
+	mHeight = 0;
+}
+
+LTexture::~LTexture()
+{
+	//Deallocate
+	free();
+}
+
+SDL_Surface* loadSurface( std::string path )
+{
+	PROFILE_SCOPE( "decode" );
+
+	//Load image at specified path
+	SDL_Surface* loadedSurface = IMG_Load( path.c_str() );
+	if( loadedSurface == NULL )
+	{
+		printf( "Unable to load image %s! SDL_image Error: %s\n", path.c_str(), IMG_GetError() );
+	}
+	else
+	{
+		//Color key image
+		SDL_SetColorKey( loadedSurface, SDL_TRUE, SDL_MapRGB( loadedSurface->format, 0xFF, 0xFF, 0xFF ) );
+
+		//Convert once here so the upload can copy the pixels as they are
+		loadedSurface = normalizeSurface( loadedSurface );
+		if( loadedSurface == NULL )
+		{
+			printf( "Unable to convert image %s! SDL Error: %s\n", path.c_str(), SDL_GetError() );
+		}
+	}
+
+	return loadedSurface;
+}
+
+SDL_Surface* normalizeSurface( SDL_Surface* surface )
+{
+	if( surface == NULL )
+	{
+		return NULL;
+	}
+
+	//Nothing to do for pixels already stored the way textures want them
+	if( surface->format->format == gTextureFormat && !SDL_HasColorKey( surface ) && !gOptions.premultiplied )
+	{
+		return surface;
+	}
+
+	PROFILE_SCOPE( "normalize" );
+	Uint64 start = SDL_GetPerformanceCounter();
+
+	//Converting to a format with alpha turns keyed pixels transparent
+	SDL_Surface* normalized = SDL_ConvertSurfaceFormat( surface, gTextureFormat, 0 );
+	SDL_FreeSurface( surface );
+	if( normalized == NULL )
+	{
+		return NULL;
+	}
+
+	//The key is in the alpha now, left set it would send every blit and upload down the keyed path
+	SDL_SetColorKey( normalized, SDL_FALSE, 0 );
+
+	if( gOptions.premultiplied )
+	{
+		SDL_PremultiplyAlpha( normalized->w, normalized->h, normalized->format->format, normalized->pixels, normalized->pitch, normalized->format->format, normalized->pixels, normalized->pitch );
+	}
+
+	++gTextureStats.conversions;
+	gTextureStats.conversionTicks += SDL_GetPerformanceCounter() - start;
+	return normalized;
+}
+
+void chooseTextureFormat()
+{
+	//Renderers list the formats they take natively, the first being the one they prefer
+	SDL_RendererInfo info;
+	if( SDL_GetRendererInfo( gRenderer, &info ) == 0 )
+	{
+		for( Uint32 i = 0; i < info.num_texture_formats; ++i )
+		{
+			Uint32 format = info.texture_formats[ i ];
+			if( !SDL_ISPIXELFORMAT_FOURCC( format ) && SDL_BITSPERPIXEL( format ) == 32 && SDL_ISPIXELFORMAT_ALPHA( format ) )
+			{
+				gTextureFormat = format;
+				break;
+			}
+		}
+	}
+
+	//Premultiplied pixels are added over what is underneath rather than blended with it
+	gPremultipliedBlendMode = SDL_ComposeCustomBlendMode( SDL_BLENDFACTOR_ONE, SDL_BLENDFACTOR_ONE_MINUS_SRC_ALPHA, SDL_BLENDOPERATION_ADD, SDL_BLENDFACTOR_ONE, SDL_BLENDFACTOR_ONE_MINUS_SRC_ALPHA, SDL_BLENDOPERATION_ADD );
+
+	//Not every renderer takes custom blend modes, so try it on a texture before relying on it
+	SDL_Texture* probe = SDL_CreateTexture( gRenderer, gTextureFormat, SDL_TEXTUREACCESS_STATIC, 1, 1 );
+	gPremultipliedBlendSupported = probe != NULL && SDL_SetTextureBlendMode( probe, gPremultipliedBlendMode ) == 0;
+	if( probe != NULL )
+	{
+		SDL_DestroyTexture( probe );
+	}
+
+	//Premultiplied pixels drawn with plain blending would come out with dark edges, so load straight alpha instead
+	if( gOptions.premultiplied )
+	{
+		if( gPremultipliedBlendSupported )
+		{
+			gTextureBlendMode = gPremultipliedBlendMode;
+		}
+		else
+		{
+			printf( "Warning: Renderer cannot blend premultiplied alpha, keeping straight alpha! SDL Error: %s\n", SDL_GetError() );
+			gOptions.premultiplied = false;
+		}
+	}
+
+	//Compact storage only saves memory where the 16 bit formats are sampled natively, elsewhere SDL would convert them back to 32 bits
+	gCompactStorageSupported = findNativeFormat( COMPACT_OPAQUE_FORMATS, SDL_arraysize( COMPACT_OPAQUE_FORMATS ) ) != SDL_PIXELFORMAT_UNKNOWN || findNativeFormat( COMPACT_KEYED_FORMATS, SDL_arraysize( COMPACT_KEYED_FORMATS ) ) != SDL_PIXELFORMAT_UNKNOWN;
+	if( gOptions.compactTextures && !gCompactStorageSupported )
+	{
+		printf( "Warning: Renderer has no native 16 bit texture formats, --texture-storage auto saves nothing here!\n" );
+	}
+}
+
+TextureStorage analyzeStorage( SDL_Surface* surface )
+{
+	//Only normalized pixels are understood
+	if( surface->format->BytesPerPixel != 4 )
+	{
+		return STORAGE_FULL;
+	}
+	Uint32 alphaMask = surface->format->Amask;
+	if( alphaMask == 0 )
+	{
+		return STORAGE_OPAQUE;
+	}
+
+	PROFILE_SCOPE( "analyze" );
+	TextureStorage storage = STORAGE_OPAQUE;
+	for( int y = 0; y < surface->h; ++y )
+	{
+		const Uint32* row = (const Uint32*)( (const Uint8*)surface->pixels + y * surface->pitch );
+		for( int x = 0; x < surface->w; ++x )
+		{
+			Uint32 alpha = row[ x ] & alphaMask;
+			if( alpha == 0 )
+			{
+				storage = STORAGE_KEYED;
+			}
+			else if( alpha != alphaMask )
+			{
+				return STORAGE_FULL;
+			}
+		}
+	}
+	return storage;
+}
+
+Uint32 chooseStorageFormat( SDL_Surface* surface )
+{
+	//Not worth looking at the pixels when no smaller format could be used anyway
+	if( !gOptions.compactTextures || !gCompactStorageSupported )
+	{
+		return gTextureFormat;
+	}
+
+	//Only formats the renderer takes natively, anything else would be converted again behind our backs
+	Uint32 format = SDL_PIXELFORMAT_UNKNOWN;
+	switch( analyzeStorage( surface ) )
+	{
+		case STORAGE_OPAQUE: format = findNativeFormat( COMPACT_OPAQUE_FORMATS, SDL_arraysize( COMPACT_OPAQUE_FORMATS ) ); break;
+		case STORAGE_KEYED: format = findNativeFormat( COMPACT_KEYED_FORMATS, SDL_arraysize( COMPACT_KEYED_FORMATS ) ); break;
+		case STORAGE_FULL: break;
+	}
+	return format != SDL_PIXELFORMAT_UNKNOWN ? format : gTextureFormat;
+}
+
+Uint32 findNativeFormat( const Uint32* formats, int count )
+{
+	SDL_RendererInfo info;
+	if( SDL_GetRendererInfo( gRenderer, &info ) == 0 )
+	{
+		for( int c = 0; c < count; ++c )
+		{
+			for( Uint32 i = 0; i < info.num_texture_formats; ++i )
+			{
+				if( info.texture_formats[ i ] == formats[ c ] )
+				{
+					return formats[ c ];
+				}
+			}
+		}
+	}
+	return SDL_PIXELFORMAT_UNKNOWN;
+}
+
+const char* getCompactStorageState()
+{
+	if( !gOptions.compactTextures )
+	{
+		return "off";
+	}
+	return gCompactStorageSupported ? "on" : "unsupported";
+}
+
+void countTextureMemory( SDL_Texture* texture )
+{
+	//The texture knows its own size and format, so whatever frees it takes back exactly what was added
+	Uint32 format;
+	int width, height;
+	if( texture != NULL && SDL_QueryTexture( texture, &format, NULL, &width, &height ) == 0 )
+	{
+		gTextureStats.storedBytes += (Uint64)width * height * SDL_BYTESPERPIXEL( format );
+		gTextureStats.fullBytes += (Uint64)width * height * 4;
+	}
+}
+
+void uncountTextureMemory( SDL_Texture* texture )
+{
+	Uint32 format;
+	int width, height;
+	if( texture != NULL && SDL_QueryTexture( texture, &format, NULL, &width, &height ) == 0 )
+	{
+		gTextureStats.storedBytes -= (Uint64)width * height * SDL_BYTESPERPIXEL( format );
+		gTextureStats.fullBytes -= (Uint64)width * height * 4;
+	}
+}
+
+AssetPack::AssetPack()
+{
+	//Initialize
+	mData = NULL;
+	mSize = 0;
+}
+
+AssetPack::~AssetPack()
+{
+	//Deallocate
+	close();
+}
+
+bool AssetPack::open( std::string path )
+{
+	//Get rid of a preexisting mapping
+	close();
+
+	int file = ::open( path.c_str(), O_RDONLY );
+	if( file < 0 )
+	{
+		return false;
+	}
+
+	//Map the whole file, the pages fault in as images are read
+	struct stat info;
+	if( fstat( file, &info ) == 0 && info.st_size >= (off_t)sizeof( Header ) )
+	{
+		void* data = mmap( NULL, info.st_size, PROT_READ, MAP_PRIVATE, file, 0 );
+		if( data != MAP_FAILED )
+		{
+			mData = (Uint8*)data;
+			mSize = info.st_size;
+		}
+	}
+	::close( file );
+	if( mData == NULL )
+	{
+		printf( "Unable to map asset pack %s!\n", path.c_str() );
+		return false;
+	}
+
+	//Only use packs this build can read as is
+	const Header* header = (const Header*)mData;
+	size_t tablesEnd = sizeof( Header ) + (size_t)header->entryCount * sizeof( Entry ) + (size_t)header->clipCount * sizeof( SDL_Rect );
+	if( memcmp( header->magic, "SPAK", 4 ) != 0 || header->version != VERSION || header->pixelFormat != LOADED_PIXEL_FORMAT || tablesEnd > mSize )
+	{
+		printf( "Asset pack %s is stale, rebuild it with --pack\n", path.c_str() );
+		close();
+		return false;
+	}
+
+	return true;
+}
+
+const AssetPack::Entry* AssetPack::findEntry( std::string name )
+{
+	if( mData == NULL )
+	{
+		return NULL;
+	}
+
+	const Header* header = (const Header*)mData;
+	const Entry* entries = (const Entry*)( mData + sizeof( Header ) );
+	for( Uint32 i = 0; i < header->entryCount; ++i )
+	{
+		if( name == entries[ i ].name )
+		{
+			//Ignore entries whose pixels run past the file
+			if( entries[ i ].pixelOffset + (Uint64)entries[ i ].pitch * entries[ i ].height > mSize )
+			{
+				return NULL;
+			}
+			return &entries[ i ];
+		}
+	}
+	return NULL;
+}
+
+SDL_Surface* AssetPack::getSurface( std::string name )
+{
+	const Entry* entry = findEntry( name );
+	if( entry == NULL )
+	{
+		return NULL;
+	}
+
+	//Point the surface straight at the mapping, uploads read from it with no copy
+	const Header* header = (const Header*)mData;
+	return SDL_CreateRGBSurfaceWithFormatFrom( mData + entry->pixelOffset, entry->width, entry->height, 32, entry->pitch, header->pixelFormat );
+}
+
+std::vector<SDL_Rect> AssetPack::getClips( std::string name )
+{
+	std::vector<SDL_Rect> clips;
+	const Entry* entry = findEntry( name );
+	if( entry != NULL )
+	{
+		const Header* header = (const Header*)mData;
+		const SDL_Rect* table = (const SDL_Rect*)( mData + sizeof( Header ) + header->entryCount * sizeof( Entry ) );
+		for( Uint32 i = 0; i < entry->clipCount && entry->firstClip + i < header->clipCount; ++i )
+		{
+			clips.push_back( table[ entry->firstClip + i ] );
+		}
+	}
+	return clips;
+}
+
+void AssetPack::close()
+{
+	if( mData != NULL )
+	{
+		munmap( mData, mSize );
+		mData = NULL;
+		mSize = 0;
+	}
+}
+
+bool AssetPack::write( std::string path, std::vector<std::string>& names, std::vector<SDL_Surface*>& surfaces, std::vector<std::vector<SDL_Rect>>& clips )
+{
+	//Pixel rows start on cache line boundaries
+	const Uint64 alignment = 64;
+
+	Header header = {};
+	memcpy( header.magic, "SPAK", 4 );
+	header.version = VERSION;
+	header.pixelFormat = LOADED_PIXEL_FORMAT;
+	header.entryCount = (Uint32)names.size();
+
+	//Lay out the entries and the clip table
+	std::vector<Entry> entries( names.size() );
+	std::vector<SDL_Rect> clipTable;
+	for( int i = 0; i < (int)names.size(); ++i )
+	{
+		if( names[ i ].size() >= sizeof( entries[ i ].name ) || surfaces[ i ]->format->format != LOADED_PIXEL_FORMAT )
+		{
+			printf( "Unable to pack %s!\n", names[ i ].c_str() );
+			return false;
+		}
+		strcpy( entries[ i ].name, names[ i ].c_str() );
+		entries[ i ].width = surfaces[ i ]->w;
+		entries[ i ].height = surfaces[ i ]->h;
+		entries[ i ].pitch = surfaces[ i ]->w * 4;
+		entries[ i ].firstClip = (Uint32)clipTable.size();
+		entries[ i ].clipCount = (Uint32)clips[ i ].size();
+		clipTable.insert( clipTable.end(), clips[ i ].begin(), clips[ i ].end() );
+	}
+	header.clipCount = (Uint32)clipTable.size();
+
+	//Then the pixels
+	Uint64 offset = sizeof( Header ) + entries.size() * sizeof( Entry ) + clipTable.size() * sizeof( SDL_Rect );
+	for( int i = 0; i < (int)entries.size(); ++i )
+	{
+		offset = ( offset + alignment - 1 ) / alignment * alignment;
+		entries[ i ].pixelOffset = offset;
+		offset += (Uint64)entries[ i ].pitch * entries[ i ].height;
+	}
+
+	FILE* file = fopen( path.c_str(), "wb" );
+	if( file == NULL )
+	{
+		printf( "Unable to open %s for writing!\n", path.c_str() );
+		return false;
+	}
+	bool success = fwrite( &header, sizeof( header ), 1, file ) == 1;
+	success = success && ( entries.empty() || fwrite( entries.data(), sizeof( Entry ), entries.size(), file ) == entries.size() );
+	success = success && ( clipTable.empty() || fwrite( clipTable.data(), sizeof( SDL_Rect ), clipTable.size(), file ) == clipTable.size() );
+	for( int i = 0; success && i < (int)entries.size(); ++i )
+	{
+		//Pad up to the entry's offset
+		static const char zeros[ 64 ] = {};
+		long position = ftell( file );
+		success = position >= 0 && fwrite( zeros, 1, entries[ i ].pixelOffset - position, file ) == entries[ i ].pixelOffset - position;
+
+		//Write tightly packed rows
+		for( int y = 0; success && y < surfaces[ i ]->h; ++y )
+		{
+			const Uint8* row = (const Uint8*)surfaces[ i ]->pixels + y * surfaces[ i ]->pitch;
+			success = fwrite( row, 1, entries[ i ].pitch, file ) == entries[ i ].pitch;
+		}
+	}
+	if( fclose( file ) != 0 )
+	{
+		success = false;
+	}
+	if( !success )
+	{
+		printf( "Unable to write asset pack %s!\n", path.c_str() );
+	}
+	return success;
+}
+
+AssetLoader::AssetLoader( AssetPack* pack, int threadCount )
+{
+	//Initialize
+	mPack = pack;
+	mStopping = false;
+	mQueued = 0;
+	mFinished = 0;
+
+	//One worker per core by default
+	if( threadCount <= 0 )
+	{
+		threadCount = std::max( 1, SDL_GetCPUCount() );
+	}
+	for( int i = 0; i < threadCount; ++i )
+	{
+		mWorkers.push_back( std::thread( &AssetLoader::workerLoop, this ) );
+	}
+}
+
+AssetLoader::~AssetLoader()
+{
+	//Let the workers drain the queue and exit
+	{
+		std::lock_guard<std::mutex> lock( mMutex );
+		mStopping = true;
+	}
+	mCondition.notify_all();
+	for( int i = 0; i < (int)mWorkers.size(); ++i )
+	{
+		mWorkers[ i ].join();
+	}
+}
+
+std::shared_future<SDL_Surface*> AssetLoader::load( std::string path )
+{
+	//Precompiled images are ready straight away, and still map the pack unless the renderer wants another format
+	SDL_Surface* packed = mPack != NULL ? normalizeSurface( mPack->getSurface( path ) ) : NULL;
+	if( packed != NULL )
+	{
+		std::promise<SDL_Surface*> ready;
+		ready.set_value( packed );
+		++mQueued;
+		++mFinished;
+		return ready.get_future().share();
+	}
+
+	//Decode, color key and convert off the render thread
+	std::packaged_task<SDL_Surface*()> task( [ path ]() { return loadSurface( path ); } );
+	std::shared_future<SDL_Surface*> result = task.get_future().share();
+	{
+		std::lock_guard<std::mutex> lock( mMutex );
+		mQueue.push_back( std::move( task ) );
+		++mQueued;
+	}
+	mCondition.notify_one();
+	return result;
+}
+
+JobCounter::JobCounter()
+{
+	mUnfinished = 0;
+}
+
+bool JobCounter::isDone()
+{
+	return mUnfinished == 0;
+}
+
+thread_local int JobSystem::sThreadIndex = 0;
+
+JobSystem::JobSystem( int threadCount )
+{
+	//Initialize
+	mQueued = 0;
+	mStopping = false;
+	mHeld.reserve( 64 );
+
+	//One thread per core by default, this one included
+	if( threadCount <= 0 )
+	{
+		threadCount = std::max( 1, SDL_GetCPUCount() );
+	}
+	for( int i = 0; i < threadCount; ++i )
+	{
+		mDeques.push_back( std::unique_ptr<Deque>( new Deque() ) );
+		mDeques.back()->ring.resize( 256 );
+	}
+	for( int i = 1; i < threadCount; ++i )
+	{
+		mWorkers.push_back( std::thread( &JobSystem::workerLoop, this, i ) );
+	}
+}
+
+JobSystem::~JobSystem()
+{
+	{
+		std::lock_guard<std::mutex> lock( mSleepMutex );
+		mStopping = true;
+	}
+	mWake.notify_all();
+	for( int i = 0; i < (int)mWorkers.size(); ++i )
+	{
+		mWorkers[ i ].join();
+	}
+}
+
+void JobSystem::wait( JobCounter* counter )
+{
+	//Help out instead of blocking
+	while( !counter->isDone() )
+	{
+		if( !runOne( sThreadIndex ) )
+		{
+			std::this_thread::yield();
+		}
+	}
+}
+
+int JobSystem::getThreadCount()
+{
+	return (int)mDeques.size();
+}
+
+void JobSystem::queue( void (*function)( void*, int, int ), void* work, int begin, int end, JobCounter* done, JobCounter* after )
+{
+	Job job = { function, work, begin, end, done, after };
+	if( done != NULL )
+	{
+		++done->mUnfinished;
+	}
+
+	//Hold the job until its dependency finishes, the last job of a counter checks for held jobs after counting down
+	if( after != NULL )
+	{
+		std::lock_guard<std::mutex> lock( mHeldMutex );
+		if( after->mUnfinished > 0 )
+		{
+			mHeld.push_back( job );
+			return;
+		}
+	}
+	push( job );
+}
+
+void JobSystem::push( Job& job )
+{
+	Deque& deque = *mDeques[ sThreadIndex ];
+	{
+		std::lock_guard<std::mutex> lock( deque.mutex );
+
+		//Grow the ring, keeping jobs in order from the head
+		int capacity = (int)deque.ring.size();
+		if( deque.count == capacity )
+		{
+			std::vector<Job> ring( capacity * 2 );
+			for( int i = 0; i < deque.count; ++i )
+			{
+				ring[ i ] = deque.ring[ ( deque.head + i ) % capacity ];
+			}
+			deque.ring.swap( ring );
+			deque.head = 0;
+			capacity *= 2;
+		}
+		deque.ring[ ( deque.head + deque.count ) % capacity ] = job;
+		++deque.count;
+	}
+	++mQueued;
+
+	//Taking the sleep lock keeps a worker from missing the wake up between its check and its wait
+	{
+		std::lock_guard<std::mutex> lock( mSleepMutex );
+	}
+	mWake.notify_one();
+}
+
+bool JobSystem::runOne( int index )
+{
+	//Newest own job first while it is still in cache, then the oldest job of the others
+	Job job;
+	bool found = false;
+	int count = (int)mDeques.size();
+	for( int i = 0; i < count && !found; ++i )
+	{
+		Deque& deque = *mDeques[ ( index + i ) % count ];
+		std::lock_guard<std::mutex> lock( deque.mutex );
+		if( deque.count > 0 )
+		{
+			int capacity = (int)deque.ring.size();
+			if( i == 0 )
+			{
+				job = deque.ring[ ( deque.head + deque.count - 1 ) % capacity ];
+			}
+			else
+			{
+				job = deque.ring[ deque.head ];
+				deque.head = ( deque.head + 1 ) % capacity;
+			}
+			--deque.count;
+			found = true;
+		}
+	}
+	if( !found )
+	{
+		return false;
+	}
+	--mQueued;
+
+	job.function( job.work, job.begin, job.end );
+
+	//The counter may be gone as soon as it reads zero, so only held jobs are looked at afterwards
+	if( job.done != NULL && --job.done->mUnfinished == 0 )
+	{
+		std::lock_guard<std::mutex> lock( mHeldMutex );
+		for( int i = 0; i < (int)mHeld.size(); )
+		{
+			if( mHeld[ i ].after->mUnfinished == 0 )
+			{
+				Job released = mHeld[ i ];
+				mHeld[ i ] = mHeld.back();
+				mHeld.pop_back();
+				push( released );
+			}
+			else
+			{
+				++i;
+			}
+		}
+	}
+	return true;
+}
+
+void JobSystem::workerLoop( int index )
+{
+	sThreadIndex = index;
+	while( true )
+	{
+		if( runOne( index ) )
+		{
+			continue;
+		}
+
+		//Sleep until there is work or the system stops
+		std::unique_lock<std::mutex> lock( mSleepMutex );
+		mWake.wait( lock, [ this ]() { return mStopping || mQueued > 0; } );
+		if( mStopping && mQueued <= 0 )
+		{
+			return;
+		}
+	}
+}
+
+float AssetLoader::getProgress()
+{
+	int queued = mQueued;
+	return queued == 0 ? 1.f : (float)mFinished / queued;
+}
+
+void AssetLoader::workerLoop()
+{
+	while( true )
+	{
+		//Wait for work
+		std::packaged_task<SDL_Surface*()> task;
+		{
+			std::unique_lock<std::mutex> lock( mMutex );
+			mCondition.wait( lock, [ this ]() { return mStopping || !mQueue.empty(); } );
+			if( mQueue.empty() )
+			{
+				return;
+			}
+			task = std::move( mQueue.front() );
+			mQueue.pop_front();
+		}
+
+		//Decode
+		task();
+		++mFinished;
+	}
+}
+
+bool LTexture::loadFromFile( std::string path )
+{
+	//Get rid of preexisting texture
+	free();
+
+	//Load image at specified path, decoded pixels are shared with anything else loading it
+	ImageHandle loadedSurface = gTextureCache.acquireImage( path );
+	if( loadedSurface )
+	{
+		//Create texture from surface pixels
+		if( !loadFromSurface( loadedSurface.get() ) )
+		{
+			printf( "Unable to create texture from %s! SDL Error: %s\n", path.c_str(), SDL_GetError() );
+		}
+	}
+
+	//Return success
+	return mTexture != NULL;
+}
+
+bool LTexture::loadFromSurface( SDL_Surface* surface )
+{
+	//Get rid of preexisting texture
+	free();
+
+	//Normalized pixels are copied up as they are, anything else is left to SDL to convert
+	if( surface->format->format == gTextureFormat && !SDL_HasColorKey( surface ) )
+	{
+		//Content that fits a smaller format is converted once here so the upload still copies
+		Uint32 format = chooseStorageFormat( surface );
+		SDL_Surface* stored = format != gTextureFormat ? SDL_ConvertSurfaceFormat( surface, format, 0 ) : surface;
+		if( stored == NULL )
+		{
+			format = gTextureFormat;
+			stored = surface;
+		}
+
+		mTexture = SDL_CreateTexture( gRenderer, format, SDL_TEXTUREACCESS_STATIC, surface->w, surface->h );
+		if( mTexture != NULL )
+		{
+			SDL_UpdateTexture( mTexture, NULL, stored->pixels, stored->pitch );
+		}
+		if( stored != surface )
+		{
+			SDL_FreeSurface( stored );
+		}
+	}
+	else
+	{
+		mTexture = SDL_CreateTextureFromSurface( gRenderer, surface );
+		++gTextureStats.slowUploads;
+	}
+	if( mTexture != NULL )
+	{
+		//Get image dimensions
+		mWidth = surface->w;
+		mHeight = surface->h;
+		SDL_SetTextureBlendMode( mTexture, gTextureBlendMode );
+		countTextureMemory( mTexture );
+	}
+
+	//Return success
+	return mTexture != NULL;
+}
+
+#if defined(SDL_TTF_MAJOR_VERSION)
+bool LTexture::loadFromRenderedText( std::string textureText, SDL_Color textColor )
+{
+	//Get rid of preexisting texture
+	free();
+
+	//Render text surface
+	SDL_Surface* textSurface = TTF_RenderText_Solid( gFont, textureText.c_str(), textColor );
+	if( textSurface != NULL )
+	{
+		//Create texture from surface pixels
+        mTexture = SDL_CreateTextureFromSurface( gRenderer, textSurface );
+		if( mTexture == NULL )
+		{
+			printf( "Unable to create texture from rendered text! SDL Error: %s\n", SDL_GetError() );
+		}
+		else
+		{
+			//Get image dimensions
+			mWidth = textSurface->w;
+			mHeight = textSurface->h;
+			countTextureMemory( mTexture );
+		}
+
+		//Get rid of old surface
+		SDL_FreeSurface( textSurface );
+	}
+	else
+	{
+		printf( "Unable to render text surface! SDL_ttf Error: %s\n", TTF_GetError() );
+	}
+
+	
+	//Return success
+	return mTexture != NULL;
+}
+#endif
+
+void LTexture::free()
+{
+	//Free texture if it exists
+	if( mTexture != NULL )
+	{
+		uncountTextureMemory( mTexture );
+		SDL_DestroyTexture( mTexture );
+		mTexture = NULL;
+		mWidth = 0;
+		mHeight = 0;
+	}
+}
+
+void LTexture::setColor( Uint8 red, Uint8 green, Uint8 blue )
+{
+	//Modulate texture rgb
+	SDL_SetTextureColorMod( mTexture, red, green, blue );
+}
+
+void LTexture::setBlendMode( SDL_BlendMode blending )
+{
+	//Set blending function
+	SDL_SetTextureBlendMode( mTexture, blending );
+}
+		
+void LTexture::setAlpha( Uint8 alpha )
+{
+	//Modulate texture alpha
+	SDL_SetTextureAlphaMod( mTexture, alpha );
+}
+
+void LTexture::render( int x, int y, double angle, SDL_RendererFlip flip, SDL_Rect* clip, SDL_Point* center)
+{
+	//Set rendering space and render to screen
+	SDL_Rect renderQuad = { x, y, mWidth, mHeight };
+
+	//Set clip rendering dimensions
+	if( clip != NULL )
+	{
+		renderQuad.w = clip->w;
+		renderQuad.h = clip->h;
+	}
+
+	//Render to screen
+	SDL_RenderCopyEx( gRenderer, mTexture, clip, &renderQuad, angle, center, flip ); //this is just like SDL_RenderCopy with some additional stuff
+}
+
+int LTexture::getWidth()
+{
+	return mWidth;
+}
+
+int LTexture::getHeight()
+{	
+	return mHeight;
+}
+
+SDL_Texture* LTexture::getTexture()
+{
+	return mTexture;
+}
+
+void SpriteBatch::draw( LTexture& texture, float x, float y, SDL_Rect* clip, SDL_Color color )
+{
+	//Nothing to draw with
+	if( texture.getTexture() == NULL )
+	{
+		return;
+	}
+
+	//Find this texture's bucket, opening a new one on first use this frame
+	Bucket* bucket = NULL;
+	for( int i = 0; i < mActiveBuckets; ++i )
+	{
+		if( mBuckets[ i ].texture == texture.getTexture() )
+		{
+			bucket = &mBuckets[ i ];
+			break;
+		}
+	}
+	if( bucket == NULL )
+	{
+		if( mActiveBuckets == (int)mBuckets.size() )
+		{
+			mBuckets.push_back( Bucket() );
+		}
+		bucket = &mBuckets[ mActiveBuckets++ ];
+		bucket->texture = texture.getTexture();
+	}
+
+	//Source rectangle in texels
+	SDL_Rect src = { 0, 0, texture.getWidth(), texture.getHeight() };
 	if( clip != NULL )
 	{
-		SpriteQuad.w = clip->w;
-		SpriteQuad.h = clip->h;
+		src = *clip;
+	}
+
+	//Source rectangle in normalized texture coordinates
+	float u0 = (float)src.x / texture.getWidth();
+	float v0 = (float)src.y / texture.getHeight();
+	float u1 = (float)( src.x + src.w ) / texture.getWidth();
+	float v1 = (float)( src.y + src.h ) / texture.getHeight();
+
+	//Destination corners
+	float x0 = x;
+	float y0 = y;
+	float x1 = x + src.w;
+	float y1 = y + src.h;
+
+	//Premultiplied textures need a premultiplied tint, or fading quads brighten instead of thinning out
+	if( gOptions.premultiplied && color.a != 0xFF )
+	{
+		color.r = (Uint8)( color.r * color.a / 0xFF );
+		color.g = (Uint8)( color.g * color.a / 0xFF );
+		color.b = (Uint8)( color.b * color.a / 0xFF );
+	}
+
+	//Two triangles over four shared corners
+	int base = (int)bucket->vertices.size();
+	bucket->vertices.push_back( { { x0, y0 }, color, { u0, v0 } } );
+	bucket->vertices.push_back( { { x1, y0 }, color, { u1, v0 } } );
+	bucket->vertices.push_back( { { x1, y1 }, color, { u1, v1 } } );
+	bucket->vertices.push_back( { { x0, y1 }, color, { u0, v1 } } );
+
+	int quad[ 6 ] = { base, base + 1, base + 2, base, base + 2, base + 3 };
+	bucket->indices.insert( bucket->indices.end(), quad, quad + 6 );
+}
+
+void SpriteBatch::flush()
+{
+	for( int i = 0; i < mActiveBuckets; ++i )
+	{
+		Bucket& bucket = mBuckets[ i ];
+
+		//One submission for everything drawn with this texture
+		if( !bucket.indices.empty() )
+		{
+			SDL_RenderGeometry( gRenderer, bucket.texture, bucket.vertices.data(), (int)bucket.vertices.size(), bucket.indices.data(), (int)bucket.indices.size() );
+		}
+
+		//Empty the bucket but keep its storage
+		bucket.vertices.clear();
+		bucket.indices.clear();
+	}
+	mActiveBuckets = 0;
+}
+
+int SpriteBatch::getQuadCount()
+{
+	int quads = 0;
+	for( int i = 0; i < mActiveBuckets; ++i )
+	{
+		quads += (int)mBuckets[ i ].indices.size() / 6;
+	}
+	return quads;
+}
+
+TextureHandle TextureCache::acquire( std::string path )
+{
+	//Share the texture if someone still holds it
+	TextureHandle texture = find( path );
+	if( texture )
+	{
+		return texture;
+	}
+
+	//Load it once
+	LTexture* loaded = new LTexture();
+	if( !loaded->loadFromFile( path ) )
+	{
+		delete loaded;
+		return TextureHandle();
+	}
+	return share( path, loaded );
+}
+
+TextureHandle TextureCache::acquire( std::string path, SDL_Surface* decoded )
+{
+	//Share the texture if someone still holds it
+	TextureHandle texture = find( path );
+	if( texture )
+	{
+		return texture;
+	}
+
+	//Upload it once
+	LTexture* loaded = new LTexture();
+	if( !loaded->loadFromSurface( decoded ) )
+	{
+		printf( "Unable to create texture from %s! SDL Error: %s\n", path.c_str(), SDL_GetError() );
+		delete loaded;
+		return TextureHandle();
+	}
+	return share( path, loaded );
+}
+
+ImageHandle TextureCache::acquireImage( std::string path )
+{
+	//Share the pixels if someone still holds them
+	std::map<std::string, std::weak_ptr<SDL_Surface>>::iterator it = mImages.find( path );
+	if( it != mImages.end() )
+	{
+		ImageHandle image = it->second.lock();
+		if( image )
+		{
+			return image;
+		}
+	}
+
+	//Decode them once
+	SDL_Surface* decoded = loadSurface( path );
+	if( decoded == NULL )
+	{
+		return ImageHandle();
+	}
+	return acquireImage( path, decoded );
+}
+
+ImageHandle TextureCache::acquireImage( std::string path, SDL_Surface* decoded )
+{
+	if( decoded == NULL )
+	{
+		return ImageHandle();
+	}
+
+	//A second decode of a resident path is dropped in favour of the shared one
+	std::map<std::string, std::weak_ptr<SDL_Surface>>::iterator it = mImages.find( path );
+	if( it != mImages.end() )
+	{
+		ImageHandle image = it->second.lock();
+		if( image )
+		{
+			if( image.get() != decoded )
+			{
+				SDL_FreeSurface( decoded );
+			}
+			return image;
+		}
+	}
+
+	//The last handle hands the surface back to us
+	ImageHandle image( decoded, [ this, path ]( SDL_Surface* released ) { releaseImage( path, released ); } );
+	mImages[ path ] = image;
+	return image;
+}
+
+TextureHandle TextureCache::find( std::string path )
+{
+	std::map<std::string, std::weak_ptr<LTexture>>::iterator it = mEntries.find( path );
+	if( it == mEntries.end() )
+	{
+		return TextureHandle();
+	}
+	return it->second.lock();
+}
+
+TextureHandle TextureCache::share( std::string path, LTexture* loaded )
+{
+	//The last handle hands the texture back to us
+	TextureHandle texture( loaded, [ this, path ]( LTexture* released ) { release( path, released ); } );
+	mEntries[ path ] = texture;
+	return texture;
+}
+
+int TextureCache::getResidentCount()
+{
+	return (int)mEntries.size();
+}
+
+int TextureCache::getImageCount()
+{
+	return (int)mImages.size();
+}
+
+void TextureCache::release( std::string path, LTexture* texture )
+{
+	//Only forget the entry if it was not reloaded in the meantime
+	std::map<std::string, std::weak_ptr<LTexture>>::iterator it = mEntries.find( path );
+	if( it != mEntries.end() && it->second.expired() )
+	{
+		mEntries.erase( it );
+	}
+
+	//Frees the GPU texture
+	delete texture;
+}
+
+void TextureCache::releaseImage( std::string path, SDL_Surface* surface )
+{
+	//Only forget the entry if it was not reloaded in the meantime
+	std::map<std::string, std::weak_ptr<SDL_Surface>>::iterator it = mImages.find( path );
+	if( it != mImages.end() && it->second.expired() )
+	{
+		mImages.erase( it );
+	}
+
+	//Frees the pixels
+	SDL_FreeSurface( surface );
+}
+
+TiledBackground::TiledBackground()
+{
+	//Initialize
+	mTileSize = 0;
+	mOpaque = false;
+	mColumns = 0;
+	mRows = 0;
+	mFrame = 0;
+	mResident = 0;
+	mVersion = 0;
+}
+
+TiledBackground::~TiledBackground()
+{
+	//Deallocate
+	free();
+}
+
+bool TiledBackground::load( ImageHandle source, int tileSize )
+{
+	//Get rid of preexisting tiles
+	free();
+	if( !source )
+	{
+		return false;
+	}
+
+	//Checked before any conversion, a 16 bit copy no longer says
+	mOpaque = analyzeStorage( source.get() ) == STORAGE_OPAQUE;
+
+	//Keep the pixels in the format they are stored in on the GPU, so tiles and the cached layer upload them as they are
+	//A converted copy is ours alone, otherwise the decoded image stays shared through the cache
+	Uint32 format = chooseStorageFormat( source.get() );
+	if( format != source->format->format )
+	{
+		SDL_Surface* converted = SDL_ConvertSurfaceFormat( source.get(), format, 0 );
+		if( converted != NULL )
+		{
+			source = ImageHandle( converted, SDL_FreeSurface );
+		}
+	}
+	mSource = source;
+	++mVersion;
+
+	//Tiles never exceed what the renderer can hold
+	SDL_RendererInfo info;
+	if( SDL_GetRendererInfo( gRenderer, &info ) == 0 && info.max_texture_width > 0 && info.max_texture_height > 0 )
+	{
+		tileSize = std::min( tileSize, std::min( info.max_texture_width, info.max_texture_height ) );
+	}
+	mTileSize = tileSize;
+	mColumns = ( mSource->w + mTileSize - 1 ) / mTileSize;
+	mRows = ( mSource->h + mTileSize - 1 ) / mTileSize;
+
+	//Nothing is uploaded until it is needed
+	Tile empty = { NULL, 0 };
+	mTiles.assign( mColumns * mRows, empty );
+	return true;
+}
+
+SDL_Texture* TiledBackground::uploadTile( int column, int row )
+{
+	SDL_Rect area = { column * mTileSize, row * mTileSize, 0, 0 };
+	area.w = std::min( mTileSize, mSource->w - area.x );
+	area.h = std::min( mTileSize, mSource->h - area.y );
+
+	SDL_Texture* texture = SDL_CreateTexture( gRenderer, mSource->format->format, SDL_TEXTUREACCESS_STATIC, area.w, area.h );
+	if( texture == NULL )
+	{
+		printf( "Unable to create background tile! SDL Error: %s\n", SDL_GetError() );
+		return NULL;
+	}
+
+	//Point the upload at the tile's first row, keeping the source pitch
+	const Uint8* pixels = (const Uint8*)mSource->pixels + area.y * mSource->pitch + area.x * mSource->format->BytesPerPixel;
+	SDL_UpdateTexture( texture, NULL, pixels, mSource->pitch );
+	SDL_SetTextureBlendMode( texture, gTextureBlendMode );
+
+	//Only resident tiles count, the totals follow the view as tiles come and go
+	countTextureMemory( texture );
+	return texture;
+}
+
+void TiledBackground::render( int offsetX, int offsetY, SDL_Rect& view )
+{
+	if( !mSource )
+	{
+		return;
+	}
+	++mFrame;
+
+	//Keep one tile of margin around the view resident so scrolling never waits on an upload
+	SDL_Rect keep = { view.x - mTileSize, view.y - mTileSize, view.w + 2 * mTileSize, view.h + 2 * mTileSize };
+
+	//Walk every repeat of the image that reaches the kept area
+	int width = mSource->w;
+	int first = (int)floorf( (float)( keep.x - offsetX ) / width );
+	int last = (int)floorf( (float)( keep.x + keep.w - 1 - offsetX ) / width );
+	for( int copy = first; copy <= last; ++copy )
+	{
+		int copyX = offsetX + copy * width;
+
+		//Tile columns and rows of this copy that touch the kept area
+		int column0 = std::max( 0, ( keep.x - copyX ) / mTileSize );
+		int column1 = std::min( mColumns - 1, ( keep.x + keep.w - 1 - copyX ) / mTileSize );
+		int row0 = std::max( 0, ( keep.y - offsetY ) / mTileSize );
+		int row1 = std::min( mRows - 1, ( keep.y + keep.h - 1 - offsetY ) / mTileSize );
+		for( int row = row0; row <= row1; ++row )
+		{
+			for( int column = column0; column <= column1; ++column )
+			{
+				Tile& tile = mTiles[ row * mColumns + column ];
+				tile.lastUsed = mFrame;
+				if( tile.texture == NULL )
+				{
+					tile.texture = uploadTile( column, row );
+					if( tile.texture == NULL )
+					{
+						continue;
+					}
+					++mResident;
+				}
+
+				//Only draw what is actually on screen
+				SDL_Rect quad = { copyX + column * mTileSize, offsetY + row * mTileSize, std::min( mTileSize, mSource->w - column * mTileSize ), std::min( mTileSize, mSource->h - row * mTileSize ) };
+				if( SDL_HasIntersection( &quad, &view ) )
+				{
+					quad.x -= view.x;
+					quad.y -= view.y;
+					SDL_RenderCopy( gRenderer, tile.texture, NULL, &quad );
+				}
+			}
+		}
+	}
+
+	//Evict tiles that fell out of the kept area
+	for( int i = 0; i < (int)mTiles.size(); ++i )
+	{
+		if( mTiles[ i ].texture != NULL && mTiles[ i ].lastUsed != mFrame )
+		{
+			uncountTextureMemory( mTiles[ i ].texture );
+			SDL_DestroyTexture( mTiles[ i ].texture );
+			mTiles[ i ].texture = NULL;
+			--mResident;
+		}
+	}
+}
+
+void TiledBackground::free()
+{
+	unloadTiles();
+	mTiles.clear();
+	mColumns = 0;
+	mRows = 0;
+
+	if( mSource )
+	{
+		mSource.reset();
+		++mVersion;
+	}
+}
+
+void TiledBackground::unloadTiles()
+{
+	for( int i = 0; i < (int)mTiles.size(); ++i )
+	{
+		if( mTiles[ i ].texture != NULL )
+		{
+			uncountTextureMemory( mTiles[ i ].texture );
+			SDL_DestroyTexture( mTiles[ i ].texture );
+			mTiles[ i ].texture = NULL;
+		}
+	}
+	mResident = 0;
+}
+
+int TiledBackground::getWidth()
+{
+	return mSource ? mSource->w : 0;
+}
+
+int TiledBackground::getHeight()
+{
+	return mSource ? mSource->h : 0;
+}
+
+int TiledBackground::getResidentCount()
+{
+	return mResident;
+}
+
+Uint32 TiledBackground::getVersion()
+{
+	return mVersion;
+}
+
+Uint32 TiledBackground::getFormat()
+{
+	return mSource ? mSource->format->format : gTextureFormat;
+}
+
+bool TiledBackground::isOpaque()
+{
+	return mSource && mOpaque;
+}
+
+RenderLayer::RenderLayer()
+{
+	//Initialize
+	mTexture = NULL;
+	mArea = { 0, 0, 0, 0 };
+	mVersion = 0;
+	mFormat = SDL_PIXELFORMAT_UNKNOWN;
+	mOpaque = false;
+	mValid = false;
+	mFailed = false;
+	mPreviousTarget = NULL;
+	mRedraws = 0;
+}
+
+RenderLayer::~RenderLayer()
+{
+	//Deallocate
+	free();
+}
+
+bool RenderLayer::begin( SDL_Rect& area, Uint32 version, Uint32 format, bool opaque )
+{
+	//Nothing to do while the cached pixels still match, or while the same inputs keep failing so an error is only reported once
+	bool same = version == mVersion && format == mFormat && opaque == mOpaque && SDL_RectEquals( &area, &mArea );
+	if( same && ( mValid || mFailed ) )
+	{
+		return false;
+	}
+	bool resize = mTexture == NULL || area.w != mArea.w || area.h != mArea.h || format != mFormat;
+
+	//Remember what is being attempted, it only counts as cached once everything worked
+	mArea = area;
+	mVersion = version;
+	mFormat = format;
+	mOpaque = opaque;
+	mValid = false;
+	mFailed = true;
+
+	//A layer the renderer cannot hold or blend is left invalid so the caller draws directly
+	SDL_RendererInfo info;
+	if( area.w <= 0 || area.h <= 0 || ( !opaque && !gPremultipliedBlendSupported ) || !SDL_RenderTargetSupported( gRenderer ) || SDL_GetRendererInfo( gRenderer, &info ) != 0 || ( info.max_texture_width > 0 && area.w > info.max_texture_width ) || ( info.max_texture_height > 0 && area.h > info.max_texture_height ) )
+	{
+		free();
+		return false;
+	}
+
+	//Only reallocate when the size or format changes
+	if( resize )
+	{
+		free();
+		mTexture = SDL_CreateTexture( gRenderer, format, SDL_TEXTUREACCESS_TARGET, area.w, area.h );
+		if( mTexture == NULL )
+		{
+			printf( "Unable to create layer texture! SDL Error: %s\n", SDL_GetError() );
+			return false;
+		}
+		countTextureMemory( mTexture );
+	}
+
+	//Drawing into a transparent target leaves premultiplied pixels whatever the sources were, so a translucent layer always blends them as such
+	//An opaque layer covers everything under it and is simply copied, which every renderer can do
+	if( SDL_SetTextureBlendMode( mTexture, opaque ? SDL_BLENDMODE_NONE : gPremultipliedBlendMode ) != 0 )
+	{
+		printf( "Unable to set layer blend mode! SDL Error: %s\n", SDL_GetError() );
+		free();
+		return false;
+	}
+
+	//Start from transparent so uncovered parts show what is underneath
+	mPreviousTarget = SDL_GetRenderTarget( gRenderer );
+	if( SDL_SetRenderTarget( gRenderer, mTexture ) != 0 )
+	{
+		printf( "Unable to draw to layer texture! SDL Error: %s\n", SDL_GetError() );
+		return false;
+	}
+	SDL_SetRenderDrawColor( gRenderer, 0, 0, 0, 0 );
+	SDL_RenderClear( gRenderer );
+
+	mValid = true;
+	mFailed = false;
+	++mRedraws;
+	return true;
+}
+
+void RenderLayer::end()
+{
+	SDL_SetRenderTarget( gRenderer, mPreviousTarget );
+	mPreviousTarget = NULL;
+}
+
+void RenderLayer::render( int x, int y, int wrap, SDL_Rect& view )
+{
+	if( !mValid )
+	{
+		return;
+	}
+
+	//Walk every repeat that reaches the view, a single copy without wrapping
+	int left = mArea.x + x - view.x;
+	int first = 0, last = 0;
+	if( wrap > 0 )
+	{
+		first = (int)floorf( (float)( -mArea.w - left ) / wrap ) + 1;
+		last = (int)floorf( (float)( view.w - 1 - left ) / wrap );
+	}
+	for( int copy = first; copy <= last; ++copy )
+	{
+		SDL_Rect quad = { left + copy * wrap, mArea.y + y - view.y, mArea.w, mArea.h };
+		SDL_RenderCopy( gRenderer, mTexture, NULL, &quad );
+	}
+}
+
+bool RenderLayer::isValid()
+{
+	return mValid;
+}
+
+void RenderLayer::invalidate()
+{
+	//A lost or reset renderer gets another try too
+	mValid = false;
+	mFailed = false;
+}
+
+void RenderLayer::free()
+{
+	if( mTexture != NULL )
+	{
+		uncountTextureMemory( mTexture );
+		SDL_DestroyTexture( mTexture );
+		mTexture = NULL;
+	}
+	mValid = false;
+}
+
+int RenderLayer::getRedrawCount()
+{
+	return mRedraws;
+}
+
+TextureAtlas::TextureAtlas( std::string name, int pageWidth, int pageHeight )
+{
+	//Initialize
+	mName = name;
+	mPageWidth = pageWidth;
+	mPageHeight = pageHeight;
+}
+
+TextureAtlas::~TextureAtlas()
+{
+	//Deallocate
+	free();
+}
+
+bool TextureAtlas::addImage( std::string name, ImageHandle source )
+{
+	if( !source )
+	{
+		return false;
+	}
+	mSources.push_back( source );
+
+	//The whole image is one region
+	Pending pending = { name, source.get(), { 0, 0, source->w, source->h } };
+	mPending.push_back( pending );
+	return true;
+}
+
+bool TextureAtlas::addFrames( std::string name, ImageHandle source, SDL_Rect* clips, int count )
+{
+	if( !source )
+	{
+		return false;
+	}
+	mSources.push_back( source );
+
+	//Each frame is packed on its own so the sheet's empty space is dropped
+	for( int i = 0; i < count; ++i )
+	{
+		Pending pending = { name + "#" + std::to_string( i ), source.get(), clips[ i ] };
+		mPending.push_back( pending );
+	}
+	return true;
+}
+
+int TextureAtlas::fitSkyline( Page& page, int index, int w, int h )
+{
+	int x = page.skyline[ index ].x;
+	if( x + w > page.width )
+	{
+		return -1;
+	}
+
+	//Rest on the highest node under the rect's span
+	int y = 0;
+	int widthLeft = w;
+	while( widthLeft > 0 )
+	{
+		if( index >= (int)page.skyline.size() )
+		{
+			return -1;
+		}
+		y = std::max( y, page.skyline[ index ].y );
+		if( y + h > page.height )
+		{
+			return -1;
+		}
+		widthLeft -= page.skyline[ index ].w;
+		++index;
+	}
+	return y;
+}
+
+bool TextureAtlas::placeRect( Page& page, int w, int h, SDL_Point& position )
+{
+	//Pick the lowest spot, then the narrowest resting node
+	int bestIndex = -1;
+	int bestY = INT_MAX;
+	int bestWidth = INT_MAX;
+	for( int i = 0; i < (int)page.skyline.size(); ++i )
+	{
+		int y = fitSkyline( page, i, w, h );
+		if( y >= 0 && ( y < bestY || ( y == bestY && page.skyline[ i ].w < bestWidth ) ) )
+		{
+			bestIndex = i;
+			bestY = y;
+			bestWidth = page.skyline[ i ].w;
+		}
+	}
+	if( bestIndex < 0 )
+	{
+		return false;
+	}
+	position.x = page.skyline[ bestIndex ].x;
+	position.y = bestY;
+
+	//Raise the skyline over the new rect
+	SkylineNode node = { position.x, bestY + h, w };
+	page.skyline.insert( page.skyline.begin() + bestIndex, node );
+
+	//Trim the nodes the rect now covers
+	for( int i = bestIndex + 1; i < (int)page.skyline.size(); )
+	{
+		SkylineNode& previous = page.skyline[ i - 1 ];
+		SkylineNode& current = page.skyline[ i ];
+		int overlap = previous.x + previous.w - current.x;
+		if( overlap <= 0 )
+		{
+			break;
+		}
+		current.x += overlap;
+		current.w -= overlap;
+		if( current.w <= 0 )
+		{
+			page.skyline.erase( page.skyline.begin() + i );
+		}
+		else
+		{
+			break;
+		}
+	}
+
+	//Merge neighbours of equal height
+	for( int i = 0; i + 1 < (int)page.skyline.size(); )
+	{
+		if( page.skyline[ i ].y == page.skyline[ i + 1 ].y )
+		{
+			page.skyline[ i ].w += page.skyline[ i + 1 ].w;
+			page.skyline.erase( page.skyline.begin() + i + 1 );
+		}
+		else
+		{
+			++i;
+		}
+	}
+	return true;
+}
+
+bool TextureAtlas::build()
+{
+	//Gap between regions so linear filtering never samples a neighbour
+	const int padding = 1;
+
+	//Tallest first keeps the skyline flat
+	std::stable_sort( mPending.begin(), mPending.end(), []( const Pending& a, const Pending& b )
+	{
+		return a.clip.h != b.clip.h ? a.clip.h > b.clip.h : a.clip.w > b.clip.w;
+	} );
+
+	bool success = true;
+	std::vector<Page> pages;
+	std::vector<int> placedPage( mPending.size() );
+	std::vector<SDL_Point> placedAt( mPending.size() );
+	for( int i = 0; i < (int)mPending.size(); ++i )
+	{
+		int w = mPending[ i ].clip.w + padding;
+		int h = mPending[ i ].clip.h + padding;
+
+		//First page with room, or a new one sized to fit oversized images
+		int pageIndex = 0;
+		for( ; pageIndex < (int)pages.size(); ++pageIndex )
+		{
+			if( placeRect( pages[ pageIndex ], w, h, placedAt[ i ] ) )
+			{
+				break;
+			}
+		}
+		if( pageIndex == (int)pages.size() )
+		{
+			Page page;
+			page.width = std::max( mPageWidth, w );
+			page.height = std::max( mPageHeight, h );
+			page.skyline.push_back( { 0, 0, page.width } );
+			page.surface = NULL;
+			pages.push_back( page );
+			placeRect( pages.back(), w, h, placedAt[ i ] );
+		}
+		placedPage[ i ] = pageIndex;
+	}
+
+	//Compose each page on the CPU, then upload it once
+	for( int p = 0; p < (int)pages.size(); ++p )
+	{
+		Page& page = pages[ p ];
+
+		//Only grow the page as far as the skyline reaches
+		int usedHeight = 0;
+		for( int n = 0; n < (int)page.skyline.size(); ++n )
+		{
+			usedHeight = std::max( usedHeight, page.skyline[ n ].y );
+		}
+
+		page.surface = SDL_CreateRGBSurfaceWithFormat( 0, page.width, usedHeight, 32, gTextureFormat );
+		if( page.surface == NULL )
+		{
+			printf( "Unable to create atlas page! SDL Error: %s\n", SDL_GetError() );
+			success = false;
+			continue;
+		}
+
+		for( int i = 0; i < (int)mPending.size(); ++i )
+		{
+			if( placedPage[ i ] != p )
+			{
+				continue;
+			}
+
+			//Copy pixels as they are, sources are already in the page's format with keyed pixels transparent
+			SDL_Rect destination = { placedAt[ i ].x, placedAt[ i ].y, mPending[ i ].clip.w, mPending[ i ].clip.h };
+			SDL_SetSurfaceBlendMode( mPending[ i ].source, SDL_BLENDMODE_NONE );
+			SDL_BlitSurface( mPending[ i ].source, &mPending[ i ].clip, page.surface, &destination );
+		}
+
+		//Every region on the page shares the cached texture
+		TextureHandle texture = gTextureCache.acquire( mName + "#" + std::to_string( p ), page.surface );
+		if( !texture )
+		{
+			success = false;
+		}
+		SDL_FreeSurface( page.surface );
+
+		//Hand out regions on this page
+		for( int i = 0; i < (int)mPending.size(); ++i )
+		{
+			if( placedPage[ i ] == p )
+			{
+				AtlasRegion region = { texture, { placedAt[ i ].x, placedAt[ i ].y, mPending[ i ].clip.w, mPending[ i ].clip.h } };
+				mRegions[ mPending[ i ].name ] = region;
+			}
+		}
+		mPages.push_back( texture );
+	}
+
+	//Source images are no longer needed here
+	mSources.clear();
+	mPending.clear();
+
+	return success;
+}
+
+AtlasRegion* TextureAtlas::getRegion( std::string name )
+{
+	std::map<std::string, AtlasRegion>::iterator it = mRegions.find( name );
+	if( it == mRegions.end() )
+	{
+		return NULL;
+	}
+	return &it->second;
+}
+
+AtlasRegion* TextureAtlas::getRegion( std::string name, int frame )
+{
+	return getRegion( name + "#" + std::to_string( frame ) );
+}
+
+int TextureAtlas::getPageCount()
+{
+	return (int)mPages.size();
+}
+
+void TextureAtlas::free()
+{
+	mSources.clear();
+	mPending.clear();
+	mRegions.clear();
+	mPages.clear();
+}
+
+EntityHandle EntityStore::create( float x, float y, float w, float h, int spriteId, Uint32 entityFlags )
+{
+	//Reuse a free slot or open a new one
+	Uint32 slot;
+	if( !mFreeSlots.empty() )
+	{
+		slot = mFreeSlots.back();
+		mFreeSlots.pop_back();
+	}
+	else
+	{
+		slot = (Uint32)mSlotIndex.size();
+		mSlotIndex.push_back( 0 );
+		mSlotGeneration.push_back( 0 );
+	}
+
+	//Append the entity's components
+	mSlotIndex[ slot ] = (Uint32)mIndexSlot.size();
+	mIndexSlot.push_back( slot );
+	posX.push_back( x );
+	posY.push_back( y );
+	prevX.push_back( x );
+	prevY.push_back( y );
+	velX.push_back( 0 );
+	velY.push_back( 0 );
+	width.push_back( w );
+	height.push_back( h );
+	sprite.push_back( (Uint16)spriteId );
+	clip.push_back( 0 );
+	animation.push_back( NO_ANIMATION );
+	animationTime.push_back( 0 );
+	flags.push_back( entityFlags );
+
+	EntityHandle entity = { slot, mSlotGeneration[ slot ] };
+	return entity;
+}
+
+void EntityStore::destroy( EntityHandle entity )
+{
+	int index = indexOf( entity );
+	if( index < 0 )
+	{
+		return;
+	}
+
+	//Move the last entity into the hole
+	int last = getCount() - 1;
+	posX[ index ] = posX[ last ];
+	posY[ index ] = posY[ last ];
+	prevX[ index ] = prevX[ last ];
+	prevY[ index ] = prevY[ last ];
+	velX[ index ] = velX[ last ];
+	velY[ index ] = velY[ last ];
+	width[ index ] = width[ last ];
+	height[ index ] = height[ last ];
+	sprite[ index ] = sprite[ last ];
+	clip[ index ] = clip[ last ];
+	animation[ index ] = animation[ last ];
+	animationTime[ index ] = animationTime[ last ];
+	flags[ index ] = flags[ last ];
+	mIndexSlot[ index ] = mIndexSlot[ last ];
+	mSlotIndex[ mIndexSlot[ index ] ] = index;
+
+	posX.pop_back();
+	posY.pop_back();
+	prevX.pop_back();
+	prevY.pop_back();
+	velX.pop_back();
+	velY.pop_back();
+	width.pop_back();
+	height.pop_back();
+	sprite.pop_back();
+	clip.pop_back();
+	animation.pop_back();
+	animationTime.pop_back();
+	flags.pop_back();
+	mIndexSlot.pop_back();
+
+	//Outstanding handles to the slot go stale
+	++mSlotGeneration[ entity.slot ];
+	mFreeSlots.push_back( entity.slot );
+}
+
+int EntityStore::indexOf( EntityHandle entity )
+{
+	if( entity.slot >= mSlotGeneration.size() || mSlotGeneration[ entity.slot ] != entity.generation )
+	{
+		return -1;
+	}
+	return (int)mSlotIndex[ entity.slot ];
+}
+
+int EntityStore::getCount()
+{
+	return (int)mIndexSlot.size();
+}
+
+void EntityStore::reserve( int count )
+{
+	posX.reserve( count );
+	posY.reserve( count );
+	prevX.reserve( count );
+	prevY.reserve( count );
+	velX.reserve( count );
+	velY.reserve( count );
+	width.reserve( count );
+	height.reserve( count );
+	sprite.reserve( count );
+	clip.reserve( count );
+	animation.reserve( count );
+	animationTime.reserve( count );
+	flags.reserve( count );
+	mIndexSlot.reserve( count );
+	mSlotIndex.reserve( count );
+	mSlotGeneration.reserve( count );
+}
+
+SpatialHash::SpatialHash( float cellSize )
+{
+	//Initialize
+	mCellSize = cellSize;
+	mBucketMask = 0;
+}
+
+int SpatialHash::cellOf( float coordinate )
+{
+	return (int)floorf( coordinate / mCellSize );
+}
+
+Uint32 SpatialHash::bucketOf( int cellX, int cellY )
+{
+	return ( (Uint32)cellX * 73856093u ^ (Uint32)cellY * 19349663u ) & mBucketMask;
+}
+
+void SpatialHash::build( EntityStore& store )
+{
+	int count = store.getCount();
+
+	//About two buckets per entity keeps chains short
+	Uint32 buckets = 64;
+	while( buckets < (Uint32)count * 2 )
+	{
+		buckets *= 2;
+	}
+	mBucketMask = buckets - 1;
+	mBucketStart.assign( buckets + 1, 0 );
+
+	//Count the entries landing in each bucket
+	int entryCount = 0;
+	for( int i = 0; i < count; ++i )
+	{
+		int x0 = cellOf( store.posX[ i ] ), x1 = cellOf( store.posX[ i ] + store.width[ i ] );
+		int y0 = cellOf( store.posY[ i ] ), y1 = cellOf( store.posY[ i ] + store.height[ i ] );
+		for( int y = y0; y <= y1; ++y )
+		{
+			for( int x = x0; x <= x1; ++x )
+			{
+				++mBucketStart[ bucketOf( x, y ) + 1 ];
+				++entryCount;
+			}
+		}
+	}
+
+	//Turn the counts into start offsets
+	for( Uint32 b = 0; b < buckets; ++b )
+	{
+		mBucketStart[ b + 1 ] += mBucketStart[ b ];
+	}
+
+	//Scatter the entries into place
+	mEntries.resize( entryCount );
+	mEntryCellX.resize( entryCount );
+	mEntryCellY.resize( entryCount );
+	mBucketNext.assign( mBucketStart.begin(), mBucketStart.end() - 1 );
+	for( int i = 0; i < count; ++i )
+	{
+		int x0 = cellOf( store.posX[ i ] ), x1 = cellOf( store.posX[ i ] + store.width[ i ] );
+		int y0 = cellOf( store.posY[ i ] ), y1 = cellOf( store.posY[ i ] + store.height[ i ] );
+		for( int y = y0; y <= y1; ++y )
+		{
+			for( int x = x0; x <= x1; ++x )
+			{
+				int slot = mBucketNext[ bucketOf( x, y ) ]++;
+				mEntries[ slot ] = i;
+				mEntryCellX[ slot ] = x;
+				mEntryCellY[ slot ] = y;
+			}
+		}
+	}
+}
+
+void SpatialHash::query( EntityStore& store, const SDL_FRect& box, FrameVector<int>& found )
+{
+	int rowBegin, rowEnd;
+	getRows( box, rowBegin, rowEnd );
+	queryRows( store, box, rowBegin, rowEnd, found );
+}
+
+void SpatialHash::queryRows( EntityStore& store, const SDL_FRect& box, int rowBegin, int rowEnd, FrameVector<int>& found )
+{
+	//Nothing built yet
+	if( mBucketStart.empty() )
+	{
+		return;
+	}
+
+	int x0 = cellOf( box.x ), x1 = cellOf( box.x + box.w );
+	int y0 = cellOf( box.y );
+	for( int y = rowBegin; y < rowEnd; ++y )
+	{
+		for( int x = x0; x <= x1; ++x )
+		{
+			Uint32 bucket = bucketOf( x, y );
+			for( int e = mBucketStart[ bucket ]; e < mBucketStart[ bucket + 1 ]; ++e )
+			{
+				//Skip other cells sharing the bucket
+				int i = mEntries[ e ];
+				if( mEntryCellX[ e ] != x || mEntryCellY[ e ] != y )
+				{
+					continue;
+				}
+
+				//Multi cell entities are only reported from their top left cell inside the box
+				if( std::max( cellOf( store.posX[ i ] ), x0 ) != x || std::max( cellOf( store.posY[ i ] ), y0 ) != y )
+				{
+					continue;
+				}
+
+				//Exact overlap test
+				if( store.posX[ i ] < box.x + box.w && box.x < store.posX[ i ] + store.width[ i ] &&
+					store.posY[ i ] < box.y + box.h && box.y < store.posY[ i ] + store.height[ i ] )
+				{
+					found.push_back( i );
+				}
+			}
+		}
+	}
+}
+
+void SpatialHash::getRows( const SDL_FRect& box, int& rowBegin, int& rowEnd )
+{
+	rowBegin = cellOf( box.y );
+	rowEnd = cellOf( box.y + box.h ) + 1;
+}
+
+void SpatialHash::findPairs( EntityStore& store, Uint32 flagsA, Uint32 flagsB, FrameVector<std::pair<int, int>>& pairs )
+{
+	for( Uint32 bucket = 0; bucket + 1 < mBucketStart.size(); ++bucket )
+	{
+		int begin = mBucketStart[ bucket ];
+		int end = mBucketStart[ bucket + 1 ];
+		for( int ea = begin; ea < end; ++ea )
+		{
+			int a = mEntries[ ea ];
+			if( !( store.flags[ a ] & flagsA ) )
+			{
+				continue;
+			}
+			for( int eb = begin; eb < end; ++eb )
+			{
+				int b = mEntries[ eb ];
+				if( a == b || !( store.flags[ b ] & flagsB ) || mEntryCellX[ ea ] != mEntryCellX[ eb ] || mEntryCellY[ ea ] != mEntryCellY[ eb ] )
+				{
+					continue;
+				}
+
+				//Exact overlap test
+				float left = std::max( store.posX[ a ], store.posX[ b ] );
+				float top = std::max( store.posY[ a ], store.posY[ b ] );
+				if( left >= std::min( store.posX[ a ] + store.width[ a ], store.posX[ b ] + store.width[ b ] ) ||
+					top >= std::min( store.posY[ a ] + store.height[ a ], store.posY[ b ] + store.height[ b ] ) )
+				{
+					continue;
+				}
+
+				//Report the pair only from the cell holding the overlap's top left corner
+				if( cellOf( left ) == mEntryCellX[ ea ] && cellOf( top ) == mEntryCellY[ ea ] )
+				{
+					pairs.push_back( std::make_pair( a, b ) );
+				}
+			}
+		}
+	}
+}
+
+Sprite::Sprite( EntityStore& store, float x, float y ) : mStore( store )
+{
+	//Size the sprite by its first walking frame
+	SDL_Rect& size = gSpriteFrames[ SPRITE_WALK ][ 0 ]->rect;
+	mEntity = mStore.create( x, y, (float)size.w, (float)size.h, SPRITE_WALK, ENTITY_PLAYER );
+	updateAnimation( mStore.indexOf( mEntity ) );
+}
+
+void Sprite::handleEvent( SDL_Event& e )
+{
+	int index = mStore.indexOf( mEntity );
+	if( index < 0 )
+	{
+		return;
+	}
+	float& sprite_VelX = mStore.velX[ index ];
+	float& sprite_VelY = mStore.velY[ index ];
+	float sprite_Step = sprite_VEL * tickScale();
+
+    //If a key was pressed
+    if( e.type == SDL_KEYDOWN && e.key.repeat == 0 )
+    {
+        //Adjust the velocity
+        switch( e.key.keysym.sym )
+        {
+            case SDLK_UP: sprite_VelY -= sprite_Step; break;
+            case SDLK_DOWN: sprite_VelY += sprite_Step; break;
+            case SDLK_LEFT: sprite_VelX -= sprite_Step; break;
+            case SDLK_RIGHT: sprite_VelX += sprite_Step; break;
+        }
+    }
+    //If a key was released
+    else if( e.type == SDL_KEYUP && e.key.repeat == 0 )
+    {
+        //Adjust the velocity
+        switch( e.key.keysym.sym )
+        {
+            case SDLK_UP: sprite_VelY += sprite_Step; break;
+            case SDLK_DOWN: sprite_VelY -= sprite_Step; break;
+            case SDLK_LEFT: sprite_VelX += sprite_Step; break;
+            case SDLK_RIGHT: sprite_VelX -= sprite_Step; break;
+        }
+    }
+
+	updateAnimation( index );
+}
+
+void Sprite::updateAnimation( int index )
+{
+	//Clip files without a standing clip keep walking on the spot
+	bool moving = mStore.velX[ index ] != 0 || mStore.velY[ index ] != 0;
+	Uint16 clip = gAnimations.find( moving ? "walk" : "stand" );
+	if( clip == NO_ANIMATION )
+	{
+		clip = gAnimations.find( "walk" );
+	}
+
+	//Restart only on a change so the cycle does not stutter
+	if( clip != mStore.animation[ index ] )
+	{
+		gAnimations.play( mStore, index, clip );
+	}
+}
+
+EntityHandle Sprite::getEntity()
+{
+	return mEntity;
+}
+
+InputLog::InputLog()
+{
+	mFile = NULL;
+	mNext = 0;
+	mReplaying = false;
+}
+
+InputLog::~InputLog()
+{
+	if( mFile != NULL )
+	{
+		fclose( mFile );
+	}
+}
+
+bool InputLog::record( std::string path )
+{
+	mFile = fopen( path.c_str(), "wb" );
+	if( mFile == NULL )
+	{
+		printf( "Unable to open %s for writing!\n", path.c_str() );
+		return false;
+	}
+
+	Header header = { { 'S', 'R', 'E', 'C' }, 1, (Uint32)gOptions.tickRate, 0 };
+	if( fwrite( &header, sizeof( header ), 1, mFile ) != 1 )
+	{
+		printf( "Unable to write %s!\n", path.c_str() );
+		fclose( mFile );
+		mFile = NULL;
+		return false;
+	}
+	return true;
+}
+
+bool InputLog::replay( std::string path )
+{
+	FILE* file = fopen( path.c_str(), "rb" );
+	if( file == NULL )
+	{
+		printf( "Unable to open %s!\n", path.c_str() );
+		return false;
+	}
+
+	//Ticks only mean the same thing at the rate they were recorded at
+	Header header;
+	bool success = fread( &header, sizeof( header ), 1, file ) == 1 && memcmp( header.magic, "SREC", 4 ) == 0 && header.version == 1;
+	if( success && header.ticksPerSecond != (Uint32)gOptions.tickRate )
+	{
+		printf( "%s was recorded at %u ticks per second, not %d!\n", path.c_str(), header.ticksPerSecond, gOptions.tickRate );
+		fclose( file );
+		return false;
+	}
+
+	Record record;
+	while( success && fread( &record, sizeof( record ), 1, file ) == 1 )
+	{
+		mRecords.push_back( record );
+	}
+	fclose( file );
+
+	if( !success )
+	{
+		printf( "%s is not an input recording!\n", path.c_str() );
+		mRecords.clear();
+		return false;
+	}
+
+	mNext = 0;
+	mReplaying = true;
+	return true;
+}
+
+void InputLog::write( SDL_Event& e, Uint32 tick )
+{
+	if( mFile == NULL || ( e.type != SDL_KEYDOWN && e.type != SDL_KEYUP ) )
+	{
+		return;
+	}
+
+	Record record = { tick, e.type, e.key.keysym.sym, e.key.repeat, { 0, 0, 0 } };
+	fwrite( &record, sizeof( record ), 1, mFile );
+}
+
+bool InputLog::next( Uint32 tick, SDL_Event& e )
+{
+	if( !mReplaying || mNext >= mRecords.size() || mRecords[ mNext ].tick > tick )
+	{
+		return false;
+	}
+
+	//Rebuild the event with only what the handlers read
+	Record& record = mRecords[ mNext++ ];
+	SDL_zero( e );
+	e.type = record.type;
+	if( e.type == SDL_KEYDOWN || e.type == SDL_KEYUP )
+	{
+		e.key.state = e.type == SDL_KEYDOWN ? SDL_PRESSED : SDL_RELEASED;
+		e.key.repeat = record.repeat;
+		e.key.keysym.sym = record.sym;
+	}
+	return true;
+}
+
+void InputLog::close( Uint32 tick )
+{
+	if( mFile == NULL )
+	{
+		return;
+	}
+
+	//Mark where the run stopped so playback stops there too
+	Record record = { tick, SDL_QUIT, 0, 0, { 0, 0, 0 } };
+	if( fwrite( &record, sizeof( record ), 1, mFile ) != 1 || fclose( mFile ) != 0 )
+	{
+		printf( "Unable to finish the input recording!\n" );
+	}
+	mFile = NULL;
+}
+
+bool InputLog::isReplaying()
+{
+	return mReplaying;
+}
+
+bool AnimationStore::load( std::string path )
+{
+	std::ifstream file( path.c_str() );
+	if( !file )
+	{
+		printf( "Unable to open %s!\n", path.c_str() );
+		return false;
+	}
+
+	mClips.clear();
+	mFrames.clear();
+
+	std::string line;
+	int lineNumber = 0;
+	while( std::getline( file, line ) )
+	{
+		++lineNumber;
+		if( line.empty() || line[ 0 ] == '#' )
+		{
+			continue;
+		}
+
+		//name sprite seconds-per-frame loop|once frame...
+		std::istringstream fields( line );
+		AnimationClip clip;
+		std::string spriteName, mode;
+		fields >> clip.name >> spriteName >> clip.frameTime >> mode;
+
+		clip.sprite = -1;
+		for( int i = 0; i < SPRITE_COUNT; ++i )
+		{
+			if( spriteName == SPRITE_NAMES[ i ] )
+			{
+				clip.sprite = i;
+			}
+		}
+
+		//Frames have to exist in the sprite
+		bool valid = !fields.fail() && clip.sprite >= 0 && clip.frameTime > 0 && ( mode == "loop" || mode == "once" ) && find( clip.name ) == NO_ANIMATION;
+		clip.firstFrame = (int)mFrames.size();
+		int frame;
+		while( valid && fields >> frame )
+		{
+			valid = frame >= 0 && frame < (int)gSpriteFrames[ clip.sprite ].size();
+			mFrames.push_back( (Uint16)frame );
+		}
+		clip.frameCount = (int)mFrames.size() - clip.firstFrame;
+
+		if( !valid || !fields.eof() || clip.frameCount == 0 )
+		{
+			printf( "Bad animation clip on line %d of %s!\n", lineNumber, path.c_str() );
+			return false;
+		}
+
+		clip.loop = mode == "loop";
+		clip.frameRate = 1 / clip.frameTime;
+		clip.duration = clip.frameTime * clip.frameCount;
+		mClips.push_back( clip );
+	}
+
+	return !mClips.empty() && mClips.size() < NO_ANIMATION;
+}
+
+Uint16 AnimationStore::find( std::string name )
+{
+	for( int i = 0; i < (int)mClips.size(); ++i )
+	{
+		if( mClips[ i ].name == name )
+		{
+			return (Uint16)i;
+		}
+	}
+	return NO_ANIMATION;
+}
+
+void AnimationStore::play( EntityStore& store, int index, Uint16 clip )
+{
+	store.animation[ index ] = clip;
+	store.animationTime[ index ] = 0;
+	if( clip != NO_ANIMATION )
+	{
+		store.sprite[ index ] = (Uint16)mClips[ clip ].sprite;
+		store.clip[ index ] = mFrames[ mClips[ clip ].firstFrame ];
+	}
+}
+
+void AnimationStore::advance( EntityStore& store, float seconds, int begin, int end )
+{
+	Uint16* animation = store.animation.data();
+	float* time = store.animationTime.data();
+	Uint16* clip = store.clip.data();
+	const AnimationClip* clips = mClips.data();
+	const Uint16* frames = mFrames.data();
+
+	for( int i = begin; i < end; ++i )
+	{
+		if( animation[ i ] == NO_ANIMATION )
+		{
+			continue;
+		}
+
+		//Wrap looping clips, hold the last frame of the rest
+		const AnimationClip& playing = clips[ animation[ i ] ];
+		float t = time[ i ] + seconds;
+		if( t >= playing.duration )
+		{
+			t = playing.loop ? fmodf( t, playing.duration ) : playing.duration;
+		}
+		time[ i ] = t;
+
+		int frame = std::min( (int)( t * playing.frameRate ), playing.frameCount - 1 );
+		clip[ i ] = frames[ playing.firstFrame + frame ];
+	}
+}
+
+void spawnHerd( EntityStore& store, int count )
+{
+	SDL_Rect& size = gSpriteFrames[ SPRITE_ANIMAL ][ 0 ]->rect;
+	store.reserve( store.getCount() + count );
+
+	//The original three stand still on the ground
+	float standing[ 3 ] = { SCREEN_WIDTH / 4.f, SCREEN_WIDTH / 2.f, SCREEN_WIDTH * 3 / 4.f };
+	for( int i = 0; i < count && i < 3; ++i )
+	{
+		EntityHandle animal = store.create( standing[ i ], 685, (float)size.w, (float)size.h, SPRITE_ANIMAL, ENTITY_ANIMAL | ENTITY_REFLECT );
+		gAnimations.play( store, store.indexOf( animal ), gAnimations.find( "graze" ) );
+	}
+
+	//The rest graze across the lower part of the screen, seeded so every run matches
+	std::mt19937 random( 1 );
+	std::uniform_real_distribution<float> spreadX( 0, (float)( SCREEN_WIDTH - size.w ) );
+	std::uniform_real_distribution<float> spreadY( SCREEN_HEIGHT / 2.f, (float)( SCREEN_HEIGHT - size.h ) );
+	std::uniform_real_distribution<float> drift( -1, 1 );
+	for( int i = 3; i < count; ++i )
+	{
+		EntityHandle animal = store.create( spreadX( random ), spreadY( random ), (float)size.w, (float)size.h, SPRITE_ANIMAL, ENTITY_ANIMAL | ENTITY_REFLECT );
+		int index = store.indexOf( animal );
+		store.velX[ index ] = drift( random ) * tickScale();
+		store.velY[ index ] = drift( random ) * tickScale();
+		gAnimations.play( store, index, gAnimations.find( "graze" ) );
+	}
+}
+
+void moveAxisScalar( float* pos, float* vel, const float* extent, const Uint32* flags, int begin, int end, float limit )
+{
+	for( int i = begin; i < end; ++i )
+	{
+		//Move along the axis
+		float moved = pos[ i ] + vel[ i ];
+
+		//If it went too far, stay put, bouncing back if it reflects
+		if( ( moved < 0 ) || ( moved + extent[ i ] > limit ) )
+		{
+			if( flags[ i ] & ENTITY_REFLECT )
+			{
+				vel[ i ] = -vel[ i ];
+			}
+		}
+		else
+		{
+			pos[ i ] = moved;
+		}
+	}
+}
+
+#if defined(__x86_64__) || defined(__i386__)
+void moveAxisSSE2( float* pos, float* vel, const float* extent, const Uint32* flags, int begin, int end, float limit )
+{
+	const __m128 zero = _mm_setzero_ps();
+	const __m128 edge = _mm_set1_ps( limit );
+	const __m128 signBit = _mm_set1_ps( -0.f );
+	const __m128i reflectBit = _mm_set1_epi32( ENTITY_REFLECT );
+
+	int i = begin;
+	for( ; i + 4 <= end; i += 4 )
+	{
+		__m128 p = _mm_loadu_ps( pos + i );
+		__m128 v = _mm_loadu_ps( vel + i );
+		__m128 moved = _mm_add_ps( p, v );
+
+		//Lanes that left the screen
+		__m128 out = _mm_or_ps( _mm_cmplt_ps( moved, zero ), _mm_cmpgt_ps( _mm_add_ps( moved, _mm_loadu_ps( extent + i ) ), edge ) );
+
+		//Keep the old position there, take the moved one elsewhere
+		_mm_storeu_ps( pos + i, _mm_or_ps( _mm_and_ps( out, p ), _mm_andnot_ps( out, moved ) ) );
+
+		//Flip the velocity sign of lanes that left and reflect
+		__m128i f = _mm_loadu_si128( (const __m128i*)( flags + i ) );
+		__m128 reflects = _mm_castsi128_ps( _mm_cmpeq_epi32( _mm_and_si128( f, reflectBit ), reflectBit ) );
+		_mm_storeu_ps( vel + i, _mm_xor_ps( v, _mm_and_ps( _mm_and_ps( out, reflects ), signBit ) ) );
 	}
 
-	//Render to screen
-	SDL_RenderCopy( gRenderer, mTexture, clip, &SpriteQuad );
-	SpriteQuad.x += sprite_VelX;
+	//Leftovers
+	moveAxisScalar( pos, vel, extent, flags, i, end, limit );
+}
+
+__attribute__(( target( "avx2" ) ))
+void moveAxisAVX2( float* pos, float* vel, const float* extent, const Uint32* flags, int begin, int end, float limit )
+{
+	const __m256 zero = _mm256_setzero_ps();
+	const __m256 edge = _mm256_set1_ps( limit );
+	const __m256 signBit = _mm256_set1_ps( -0.f );
+	const __m256i reflectBit = _mm256_set1_epi32( ENTITY_REFLECT );
 
-	if(SpriteQuad.x>=SCREEN_WIDTH)
+	int i = begin;
+	for( ; i + 8 <= end; i += 8 )
 	{
-		SpriteQuad.x = 0;
+		__m256 p = _mm256_loadu_ps( pos + i );
+		__m256 v = _mm256_loadu_ps( vel + i );
+		__m256 moved = _mm256_add_ps( p, v );
+
+		//Lanes that left the screen
+		__m256 out = _mm256_or_ps( _mm256_cmp_ps( moved, zero, _CMP_LT_OQ ), _mm256_cmp_ps( _mm256_add_ps( moved, _mm256_loadu_ps( extent + i ) ), edge, _CMP_GT_OQ ) );
+
+		//Keep the old position there, take the moved one elsewhere
+		_mm256_storeu_ps( pos + i, _mm256_blendv_ps( moved, p, out ) );
+
+		//Flip the velocity sign of lanes that left and reflect
+		__m256i f = _mm256_loadu_si256( (const __m256i*)( flags + i ) );
+		__m256 reflects = _mm256_castsi256_ps( _mm256_cmpeq_epi32( _mm256_and_si256( f, reflectBit ), reflectBit ) );
+		_mm256_storeu_ps( vel + i, _mm256_xor_ps( v, _mm256_and_ps( _mm256_and_ps( out, reflects ), signBit ) ) );
 	}
+
+	//Leftovers
+	moveAxisScalar( pos, vel, extent, flags, i, end, limit );
 }
+#endif
 
-void Sprite::handleEvent( SDL_Event& e )
+MoveAxisKernel selectMoveAxisKernel()
 {
-    //If a key was pressed
-    if( e.type == SDL_KEYDOWN && e.key.repeat == 0 )
-    {
-        //Adjust the velocity
-        switch( e.key.keysym.sym )
-        {
-            case SDLK_UP: sprite_VelY -= sprite_VEL; break;
-            case SDLK_DOWN: sprite_VelY += sprite_VEL; break;
-            case SDLK_LEFT: sprite_VelX -= sprite_VEL; break;
-            case SDLK_RIGHT: sprite_VelX += sprite_VEL; break;
-        }
-    }
-    //If a key was released
-    else if( e.type == SDL_KEYUP && e.key.repeat == 0 )
-    {
-        //Adjust the velocity
-        switch( e.key.keysym.sym )
-        {
-            case SDLK_UP: sprite_VelY += sprite_VEL; break;
-            case SDLK_DOWN: sprite_VelY -= sprite_VEL; break;
-            case SDLK_LEFT: sprite_VelX += sprite_VEL; break;
-            case SDLK_RIGHT: sprite_VelX -= sprite_VEL; break;
-        }
-    }
+#if defined(__x86_64__) || defined(__i386__)
+	if( SDL_HasAVX2() )
+	{
+		return moveAxisAVX2;
+	}
+	if( SDL_HasSSE2() )
+	{
+		return moveAxisSSE2;
+	}
+#endif
+	return moveAxisScalar;
+}
+
+bool testMoveAxisKernels()
+{
+	//Kernels to compare, by name
+	std::vector<std::pair<const char*, MoveAxisKernel>> kernels;
+#if defined(__x86_64__) || defined(__i386__)
+	if( SDL_HasSSE2() )
+	{
+		kernels.push_back( std::make_pair( "sse2", moveAxisSSE2 ) );
+	}
+	if( SDL_HasAVX2() )
+	{
+		kernels.push_back( std::make_pair( "avx2", moveAxisAVX2 ) );
+	}
+	else
+	{
+		printf( "AVX2 not available, skipping its kernel\n" );
+	}
+#endif
+
+	//Values that tend to trip up vector code
+	const float limit = 100;
+	const float extent = 10;
+	const float edgeCases[] = { 0.f, -0.f, limit - extent, limit, -1.f, 1e-40f, -1e-40f, std::numeric_limits<float>::quiet_NaN(), std::numeric_limits<float>::infinity(), -std::numeric_limits<float>::infinity() };
+	const int edgeCaseCount = sizeof( edgeCases ) / sizeof( edgeCases[ 0 ] );
+
+	std::mt19937 random( 1 );
+	std::uniform_real_distribution<float> spread( -20, limit + 20 );
+	std::uniform_real_distribution<float> step( -15, 15 );
+	std::uniform_int_distribution<int> pick( 0, 3 );
+
+	bool success = true;
+	for( int round = 0; round < 200; ++round )
+	{
+		//Every start alignment and every tail length of both vector widths
+		for( int begin = 0; begin < 8; ++begin )
+		{
+			for( int count = 0; count < 40; ++count )
+			{
+				int end = begin + count;
+				std::vector<float> pos( end ), vel( end ), extents( end, extent );
+				std::vector<Uint32> flags( end );
+				for( int i = 0; i < end; ++i )
+				{
+					//Mostly random, a quarter of the lanes sit on an edge or carry a special value
+					pos[ i ] = pick( random ) == 0 ? edgeCases[ random() % edgeCaseCount ] : spread( random );
+					vel[ i ] = pick( random ) == 0 ? edgeCases[ random() % edgeCaseCount ] : step( random );
+					flags[ i ] = pick( random ) < 2 ? ENTITY_REFLECT : 0;
+				}
+
+				std::vector<float> expectedPos = pos, expectedVel = vel;
+				moveAxisScalar( expectedPos.data(), expectedVel.data(), extents.data(), flags.data(), begin, end, limit );
+
+				for( int k = 0; k < (int)kernels.size(); ++k )
+				{
+					std::vector<float> testPos = pos, testVel = vel;
+					kernels[ k ].second( testPos.data(), testVel.data(), extents.data(), flags.data(), begin, end, limit );
+
+					//Bit for bit, so NaNs and signed zeros count too
+					if( end > 0 && ( memcmp( testPos.data(), expectedPos.data(), end * sizeof( float ) ) != 0 || memcmp( testVel.data(), expectedVel.data(), end * sizeof( float ) ) != 0 ) )
+					{
+						printf( "Move kernel %s differs from scalar! begin %d, count %d, round %d\n", kernels[ k ].first, begin, count, round );
+						success = false;
+					}
+				}
+			}
+		}
+	}
+
+	if( success )
+	{
+		printf( "Move kernels match scalar: %d checked\n", (int)kernels.size() );
+	}
+	return success;
+}
+
+void moveEntities( EntityStore& store, int begin, int end )
+{
+	//Resolved once, the CPU does not change under us
+	static const MoveAxisKernel moveAxis = selectMoveAxisKernel();
+
+	//Keep where the entities were for drawing in between ticks
+	std::copy( store.posX.begin() + begin, store.posX.begin() + end, store.prevX.begin() + begin );
+	std::copy( store.posY.begin() + begin, store.posY.begin() + end, store.prevY.begin() + begin );
+
+	moveAxis( store.posX.data(), store.velX.data(), store.width.data(), store.flags.data(), begin, end, (float)SCREEN_WIDTH );
+	moveAxis( store.posY.data(), store.velY.data(), store.height.data(), store.flags.data(), begin, end, (float)SCREEN_HEIGHT );
+}
+
+CullStats cullEntities( EntityStore& store, SpatialHash& grid, SDL_Rect& view, FrameVector<int>& visible, JobSystem& jobs )
+{
+	//The grid only walks the cells under the view, so off-screen herds are never touched
+	SDL_FRect box = { (float)view.x, (float)view.y, (float)view.w, (float)view.h };
+	int rowBegin, rowEnd;
+	grid.getRows( box, rowBegin, rowEnd );
+
+	//Each row fills its own list in the same arena as visible
+	FrameAllocator<int> allocator = visible.get_allocator();
+	FrameVector<FrameVector<int>> rows( std::max( 0, rowEnd - rowBegin ), FrameVector<int>( allocator ), allocator );
+	auto queryRows = [ & ]( int begin, int end )
+	{
+		PROFILE_SCOPE( "cull-row" );
+		for( int r = begin; r < end; ++r )
+		{
+			rows[ r ].clear();
+			grid.queryRows( store, box, rowBegin + r, rowBegin + r + 1, rows[ r ] );
+		}
+	};
+	JobCounter queried;
+	jobs.parallelFor( (int)rows.size(), 1, queryRows, &queried );
+	jobs.wait( &queried );
+
+	visible.clear();
+	for( int r = 0; r < (int)rows.size(); ++r )
+	{
+		visible.insert( visible.end(), rows[ r ].begin(), rows[ r ].end() );
+	}
+
+	//Draw in store order so overlapping sprites keep a stable stacking
+	std::sort( visible.begin(), visible.end() );
+
+	CullStats stats = { (int)visible.size(), store.getCount() - (int)visible.size() };
+	return stats;
+}
+
+void renderEntities( EntityStore& store, FrameVector<int>& visible, SDL_Rect& view, RenderList& list )
+{
+	//Tint for animals the player is touching
+	const SDL_Color normal = { 0xFF, 0xFF, 0xFF, 0xFF };
+	const SDL_Color touched = { 0xFF, 0x80, 0x80, 0xFF };
+
+	for( int v = 0; v < (int)visible.size(); ++v )
+	{
+		int i = visible[ v ];
+		AtlasRegion* region = gSpriteFrames[ store.sprite[ i ] ][ store.clip[ i ] ];
+		RenderCommand command;
+		command.texture = region->page.get();
+		command.src = region->rect;
+		command.dst.x = store.posX[ i ] - view.x;
+		command.dst.y = store.posY[ i ] - view.y;
+		command.dst.w = (float)region->rect.w;
+		command.dst.h = (float)region->rect.h;
+		command.previous.x = store.prevX[ i ] - view.x;
+		command.previous.y = store.prevY[ i ] - view.y;
+		command.flip = SDL_FLIP_NONE;
+		command.angle = 0;
+		command.color = ( store.flags[ i ] & ENTITY_TOUCHED ) ? touched : normal;
+		list.commands.push_back( command );
+	}
+}
+
+void drawRenderList( RenderList& list, float alpha )
+{
+	{
+	PROFILE_SCOPE( "background" );
+	float scrollingOffset = list.previousScrollingOffset + ( list.scrollingOffset - list.previousScrollingOffset ) * alpha;
+
+	//Cache one repeat of the rows in view, redrawn only when the image or the rows change
+	//Only the backdrop goes in, the layer scrolls with it while the sprites stay put on screen and the animals draw over the walking sprite
+	SDL_Rect area = { 0, list.view.y, gBackground.getWidth(), std::min( list.view.h, gBackground.getHeight() - list.view.y ) };
+	if( gBackgroundLayer.begin( area, gBackground.getVersion(), gBackground.getFormat(), gBackground.isOpaque() ) )
+	{
+		gBackground.render( 0, 0, area );
+		gBackgroundLayer.end();
+		gBackground.unloadTiles();
+	}
+
+	//Scrolling only moves the copies, backdrops too big to cache stream their tiles as before
+	if( gBackgroundLayer.isValid() )
+	{
+		gBackgroundLayer.render( (int)floorf( scrollingOffset ), 0, gBackground.getWidth(), list.view );
+	}
+	else
+	{
+		gBackground.render( (int)floorf( scrollingOffset ), 0, list.view );
+	}
+	}
+
+	//Particles go under the sprites that kick them up
+	if( list.particleRegion != NULL )
+	{
+		PROFILE_SCOPE( "particles-draw" );
+		AtlasRegion& region = *list.particleRegion;
+		float halfW = region.rect.w / 2.f, halfH = region.rect.h / 2.f;
+		for( int i = 0; i < (int)list.particles.size(); ++i )
+		{
+			RenderParticle& particle = list.particles[ i ];
+			float x = particle.previous.x + ( particle.position.x - particle.previous.x ) * alpha;
+			float y = particle.previous.y + ( particle.position.y - particle.previous.y ) * alpha;
+			gSpriteBatch.draw( *region.page, x - halfW, y - halfH, &region.rect, particle.color );
+		}
+		gSpriteBatch.flush();
+	}
+
+	PROFILE_SCOPE( "sprites" );
+	for( int i = 0; i < (int)list.commands.size(); ++i )
+	{
+		//Blend between the last two ticks
+		RenderCommand& command = list.commands[ i ];
+		SDL_FRect dst = { command.previous.x + ( command.dst.x - command.previous.x ) * alpha, command.previous.y + ( command.dst.y - command.previous.y ) * alpha, command.dst.w, command.dst.h };
+
+		//Plain unscaled quads batch, anything else is drawn on its own in order
+		if( command.angle == 0 && command.flip == SDL_FLIP_NONE && command.dst.w == command.src.w && command.dst.h == command.src.h )
+		{
+			gSpriteBatch.draw( *command.texture, dst.x, dst.y, &command.src, command.color );
+		}
+		else
+		{
+			gSpriteBatch.flush();
+			SDL_Texture* texture = command.texture->getTexture();
+			SDL_SetTextureColorMod( texture, command.color.r, command.color.g, command.color.b );
+			SDL_RenderCopyExF( gRenderer, texture, &command.src, &dst, command.angle, NULL, command.flip );
+			SDL_SetTextureColorMod( texture, 0xFF, 0xFF, 0xFF );
+		}
+	}
+	gSpriteBatch.flush();
+}
+
+RenderList::RenderList() : commands( FrameAllocator<RenderCommand>( &arena ) ), particles( FrameAllocator<RenderParticle>( &arena ) )
+{
+	//Initialize
+	scrollingOffset = 0;
+	previousScrollingOffset = 0;
+	view = { 0, 0, 0, 0 };
+	tick = 0;
+	tickTime = 0;
+	tickLength = 0;
+	particleRegion = NULL;
+	entityCount = 0;
+	cullStats = { 0, 0 };
+	tickArenaPeak = 0;
+	changedTick = 0;
+	moving = true;
+}
+
+void RenderList::clear()
+{
+	//Make room for as much as last time up front so the vectors do not regrow through the arena
+	size_t commandCount = commands.size();
+	size_t particleCount = particles.size();
+	arena.reset();
+	commands = std::vector<RenderCommand, FrameAllocator<RenderCommand>>( FrameAllocator<RenderCommand>( &arena ) );
+	particles = std::vector<RenderParticle, FrameAllocator<RenderParticle>>( FrameAllocator<RenderParticle>( &arena ) );
+	commands.reserve( commandCount );
+	particles.reserve( particleCount );
+}
+
+RenderListBuffer::RenderListBuffer()
+{
+	//Initialize
+	mWrite = 0;
+	mShared = 1;
+	mRead = 2;
+}
+
+RenderList& RenderListBuffer::getWriteList()
+{
+	return mLists[ mWrite ];
+}
+
+void RenderListBuffer::publish()
+{
+	mWrite = mShared.exchange( mWrite | FRESH ) & ~FRESH;
+}
+
+bool RenderListBuffer::acquire()
+{
+	if( !( mShared.load() & FRESH ) )
+	{
+		return false;
+	}
+	mRead = mShared.exchange( mRead ) & ~FRESH;
+	return true;
+}
+
+RenderList& RenderListBuffer::getReadList()
+{
+	return mLists[ mRead ];
+}
+
+DamageTracker::DamageTracker()
+{
+	//Initialize
+	mScrollingOffset = 0;
+	mView = { 0, 0, 0, 0 };
+	mHasFrame = false;
+}
+
+bool DamageTracker::update( RenderList& list )
+{
+	//Particles are always falling, so any at all count as a change
+	bool changed = !mHasFrame || !list.particles.empty() || list.scrollingOffset != mScrollingOffset || !SDL_RectEquals( &list.view, &mView ) || list.commands.size() != mCommands.size();
+	for( int i = 0; !changed && i < (int)mCommands.size(); ++i )
+	{
+		changed = !isSame( list.commands[ i ], mCommands[ i ] );
+	}
+
+	//Keeps its capacity, so remembering a frame no bigger than before does not allocate
+	if( changed )
+	{
+		mCommands.assign( list.commands.begin(), list.commands.end() );
+		mScrollingOffset = list.scrollingOffset;
+		mView = list.view;
+		mHasFrame = true;
+	}
+	return changed;
+}
+
+bool DamageTracker::isMoving( RenderList& list )
+{
+	if( !list.particles.empty() || list.scrollingOffset != list.previousScrollingOffset )
+	{
+		return true;
+	}
+	for( int i = 0; i < (int)list.commands.size(); ++i )
+	{
+		RenderCommand& command = list.commands[ i ];
+		if( command.previous.x != command.dst.x || command.previous.y != command.dst.y )
+		{
+			return true;
+		}
+	}
+	return false;
+}
+
+bool DamageTracker::isSame( const RenderCommand& a, const RenderCommand& b )
+{
+	return a.texture == b.texture && SDL_RectEquals( &a.src, &b.src ) && a.dst.x == b.dst.x && a.dst.y == b.dst.y && a.dst.w == b.dst.w && a.dst.h == b.dst.h && a.previous.x == b.previous.x && a.previous.y == b.previous.y && a.flip == b.flip && a.angle == b.angle && a.color.r == b.color.r && a.color.g == b.color.g && a.color.b == b.color.b && a.color.a == b.color.a;
+}
+
+FramePacer::FramePacer()
+{
+	//Initialize
+	mPolicy = PACING_UNCAPPED;
+	mPeriod = 0;
+	mDeadline = 0;
+	mSleepError = SDL_GetPerformanceFrequency() / 1000;
+	mLastPresent = 0;
+	resetStats();
+}
+
+void FramePacer::setPolicy( PacingPolicy policy, int targetFps )
+{
+	//Capping needs a rate
+	if( policy == PACING_CAPPED && targetFps <= 0 )
+	{
+		policy = PACING_UNCAPPED;
+	}
+	mPolicy = policy;
+	mPeriod = policy == PACING_CAPPED ? SDL_GetPerformanceFrequency() / targetFps : 0;
+	mDeadline = 0;
+
+	if( SDL_RenderSetVSync( gRenderer, policy == PACING_VSYNC ? 1 : 0 ) != 0 )
+	{
+		printf( "Unable to change vsync! SDL Error: %s\n", SDL_GetError() );
+	}
+}
+
+void FramePacer::wait()
+{
+	if( mPolicy != PACING_CAPPED )
+	{
+		return;
+	}
+
+	//Frames are due on a fixed schedule so waits do not drift, a frame more than a period late restarts it
+	Uint64 now = SDL_GetPerformanceCounter();
+	if( mDeadline == 0 || now > mDeadline + mPeriod )
+	{
+		mDeadline = now;
+	}
+
+	//Forget old overruns a little each frame so one descheduled sleep does not turn every later frame into a long spin
+	mSleepError -= mSleepError / 16;
+
+	//Sleep in short steps while even a recent bad overrun would land before the deadline
+	const Uint64 millisecond = SDL_GetPerformanceFrequency() / 1000;
+	while( now + millisecond + mSleepError < mDeadline )
+	{
+		std::this_thread::sleep_for( std::chrono::milliseconds( 1 ) );
+		Uint64 woke = SDL_GetPerformanceCounter();
+		Uint64 overrun = woke - now > millisecond ? woke - now - millisecond : 0;
+		now = woke;
+		if( overrun > mSleepError )
+		{
+			mSleepError = std::min( overrun, mPeriod );
+		}
+	}
+
+	//Spin off the rest on the monotonic clock
+	while( now < mDeadline )
+	{
+		std::this_thread::yield();
+		now = SDL_GetPerformanceCounter();
+	}
+	mDeadline += mPeriod;
+}
+
+void FramePacer::presented()
+{
+	Uint64 now = SDL_GetPerformanceCounter();
+	if( mLastPresent != 0 )
+	{
+		double interval = ( now - mLastPresent ) * 1000.0 / SDL_GetPerformanceFrequency();
+		++mIntervalCount;
+		mIntervalSum += interval;
+		mIntervalSquareSum += interval * interval;
+		mWorstInterval = std::max( mWorstInterval, interval );
+	}
+	mLastPresent = now;
+}
+
+double FramePacer::getMeanInterval()
+{
+	return mIntervalCount > 0 ? mIntervalSum / mIntervalCount : 0;
+}
+
+double FramePacer::getJitter()
+{
+	double mean = getMeanInterval();
+	return mIntervalCount > 0 ? sqrt( std::max( 0.0, mIntervalSquareSum / mIntervalCount - mean * mean ) ) : 0;
+}
+
+double FramePacer::getWorstInterval()
+{
+	return mWorstInterval;
+}
+
+void FramePacer::resetStats()
+{
+	mIntervalCount = 0;
+	mIntervalSum = 0;
+	mIntervalSquareSum = 0;
+	mWorstInterval = 0;
+}
+
+ParticleSystem::ParticleSystem( AtlasRegion* region, int capacity, int maxEmitters ) : mRandom( 2 )
+{
+	//Initialize
+	mRegion = region;
+	mCount = 0;
+	mCapacity = capacity;
+	mLastStep = 0;
+	mMaxEmitters = maxEmitters;
+
+	//The whole pool up front
+	mPosX.resize( capacity );
+	mPosY.resize( capacity );
+	mVelX.resize( capacity );
+	mVelY.resize( capacity );
+	mLife.resize( capacity );
+	mFade.resize( capacity );
+	mColor.resize( capacity );
+	mEmitters.reserve( maxEmitters );
+}
+
+bool ParticleSystem::addEmitter( ParticleEmitter& emitter )
+{
+	if( (int)mEmitters.size() >= mMaxEmitters )
+	{
+		return false;
+	}
+	mEmitters.push_back( emitter );
+	mEmitters.back().owed = 0;
+	return true;
+}
+
+void ParticleSystem::integrate( int begin, int end, float seconds )
+{
+	float* posX = mPosX.data();
+	float* posY = mPosY.data();
+	float* velX = mVelX.data();
+	float* velY = mVelY.data();
+	float* life = mLife.data();
+	float fall = PARTICLE_GRAVITY * seconds;
+
+	int i = begin;
+#if defined(__x86_64__) || defined(__i386__)
+	//Four particles per step, SSE2 is baseline on x86-64
+	__m128 step = _mm_set1_ps( seconds );
+	__m128 pull = _mm_set1_ps( fall );
+	for( ; i + 4 <= end; i += 4 )
+	{
+		__m128 vy = _mm_loadu_ps( velY + i );
+		_mm_storeu_ps( posX + i, _mm_add_ps( _mm_loadu_ps( posX + i ), _mm_mul_ps( _mm_loadu_ps( velX + i ), step ) ) );
+		_mm_storeu_ps( posY + i, _mm_add_ps( _mm_loadu_ps( posY + i ), _mm_mul_ps( vy, step ) ) );
+		_mm_storeu_ps( velY + i, _mm_add_ps( vy, pull ) );
+		_mm_storeu_ps( life + i, _mm_sub_ps( _mm_loadu_ps( life + i ), step ) );
+	}
+#endif
+
+	//Whatever is left over
+	for( ; i < end; ++i )
+	{
+		posX[ i ] += velX[ i ] * seconds;
+		posY[ i ] += velY[ i ] * seconds;
+		velY[ i ] += fall;
+		life[ i ] -= seconds;
+	}
+}
+
+void ParticleSystem::update( EntityStore& store, float seconds )
+{
+	mLastStep = seconds;
+
+	//Move the last live particle into each expired one
+	for( int i = 0; i < mCount; )
+	{
+		if( mLife[ i ] > 0 )
+		{
+			++i;
+			continue;
+		}
+		--mCount;
+		mPosX[ i ] = mPosX[ mCount ];
+		mPosY[ i ] = mPosY[ mCount ];
+		mVelX[ i ] = mVelX[ mCount ];
+		mVelY[ i ] = mVelY[ mCount ];
+		mLife[ i ] = mLife[ mCount ];
+		mFade[ i ] = mFade[ mCount ];
+		mColor[ i ] = mColor[ mCount ];
+	}
+
+	//Spray from under each emitting entity, dropping what does not fit in the pool
+	std::uniform_real_distribution<float> unit( 0, 1 );
+	for( int e = 0; e < (int)mEmitters.size(); ++e )
+	{
+		ParticleEmitter& emitter = mEmitters[ e ];
+		int index = store.indexOf( emitter.entity );
+		if( index < 0 || ( emitter.movingOnly && store.velX[ index ] == 0 && store.velY[ index ] == 0 ) )
+		{
+			emitter.owed = 0;
+			continue;
+		}
+
+		emitter.owed += emitter.rate * seconds;
+		int spawn = (int)emitter.owed;
+		emitter.owed -= spawn;
+		float feetX = store.posX[ index ] + store.width[ index ] / 2;
+		float feetY = store.posY[ index ] + store.height[ index ];
+		for( int n = 0; n < spawn && mCount < mCapacity; ++n, ++mCount )
+		{
+			float life = emitter.life * ( 0.5f + 0.5f * unit( mRandom ) );
+			mPosX[ mCount ] = feetX + ( unit( mRandom ) - 0.5f ) * store.width[ index ] / 2;
+			mPosY[ mCount ] = feetY;
+			mVelX[ mCount ] = ( unit( mRandom ) * 2 - 1 ) * emitter.spread;
+			mVelY[ mCount ] = -unit( mRandom ) * emitter.speed;
+			mLife[ mCount ] = life;
+			mFade[ mCount ] = 1 / life;
+			mColor[ mCount ] = emitter.color;
+		}
+	}
 }
 
-void Sprite::move()
+void ParticleSystem::render( SDL_Rect& view, RenderList& list )
 {
-    //Move the sprite left or right
-    sprite_PosX += sprite_VelX;
+	list.particleRegion = mRegion;
+	if( mRegion == NULL )
+	{
+		return;
+	}
 
-    //If the sprite went too far to the left or right
-    if( ( sprite_PosX < 0 ) || ( sprite_PosX + sprite_WIDTH > SCREEN_WIDTH ) )
-    {
-        //Move back
-        sprite_PosX -= sprite_VelY;
-    }
+	//Skip particles whose disc is off the view
+	float halfW = mRegion->rect.w / 2.f, halfH = mRegion->rect.h / 2.f;
+	for( int i = 0; i < mCount; ++i )
+	{
+		float x = mPosX[ i ] - view.x, y = mPosY[ i ] - view.y;
+		if( x + halfW < 0 || x - halfW > view.w || y + halfH < 0 || y - halfH > view.h )
+		{
+			continue;
+		}
 
-    //Move the sprite up or down
-    sprite_PosY += sprite_VelY;
+		RenderParticle particle;
+		particle.position.x = x;
+		particle.position.y = y;
+		particle.previous.x = x - mVelX[ i ] * mLastStep;
+		particle.previous.y = y - mVelY[ i ] * mLastStep;
+		particle.color = mColor[ i ];
+		particle.color.a = (Uint8)( mColor[ i ].a * std::min( 1.f, mLife[ i ] * mFade[ i ] ) );
+		list.particles.push_back( particle );
+	}
+}
 
-    //If the sprite went too far up or down
-    if( ( sprite_PosY < 0 ) || ( sprite_PosY + sprite_HEIGHT > SCREEN_HEIGHT ) )
-    {
-        //Move back
-        sprite_PosY -= sprite_VelY;
-    }
+int ParticleSystem::getCount()
+{
+	return mCount;
 }
 
-Animal::Animal()
+SDL_Surface* createDustSurface()
 {
-    posAx1 = SCREEN_WIDTH/4;
-    posAx2 = SCREEN_WIDTH/2;
-    posAx3 = SCREEN_WIDTH*3/4; 
-    posAy1 = 685;
-    posAy2 = 685;
-    posAy3 = 685;
+	const int size = 8;
+	SDL_Surface* dust = SDL_CreateRGBSurfaceWithFormat( 0, size, size, 32, LOADED_PIXEL_FORMAT );
+	if( dust == NULL )
+	{
+		printf( "Unable to create dust surface! SDL Error: %s\n", SDL_GetError() );
+		return NULL;
+	}
+
+	//White everywhere, opacity falling off from the center
+	for( int y = 0; y < size; ++y )
+	{
+		Uint32* row = (Uint32*)( (Uint8*)dust->pixels + y * dust->pitch );
+		for( int x = 0; x < size; ++x )
+		{
+			float dx = ( x + 0.5f ) / size * 2 - 1, dy = ( y + 0.5f ) / size * 2 - 1;
+			float opacity = std::max( 0.f, 1 - sqrtf( dx * dx + dy * dy ) );
+			row[ x ] = SDL_MapRGBA( dust->format, 0xFF, 0xFF, 0xFF, (Uint8)( opacity * 0xFF ) );
+		}
+	}
+	return dust;
 }
 
-void Animal::render()
+void updateContacts( EntityStore& store, SpatialHash& grid, FrameVector<std::pair<int, int>>& pairs )
 {
-	//Show the animal
-	gAnimalTexture.render( posAx1, posAy1, 0, SDL_FLIP_NONE );
-    gAnimalTexture.render( posAx2, posAy2, 0, SDL_FLIP_NONE );
-    gAnimalTexture.render( posAx3, posAy3, 0, SDL_FLIP_NONE );
+	//Forget last tick's contacts
+	int count = store.getCount();
+	for( int i = 0; i < count; ++i )
+	{
+		store.flags[ i ] &= ~ENTITY_TOUCHED;
+	}
+
+	//Broadphase, then flag every animal the player overlaps
+	grid.build( store );
+	pairs.clear();
+	grid.findPairs( store, ENTITY_PLAYER, ENTITY_ANIMAL, pairs );
+	for( int i = 0; i < (int)pairs.size(); ++i )
+	{
+		store.flags[ pairs[ i ].second ] |= ENTITY_TOUCHED;
+	}
 }
 
 bool init()
@@ -399,6 +4849,13 @@ bool init()
 	//Initialization flag
 	bool success = true;
 
+	//Benchmarks need no display or GPU
+	if( gOptions.benchFrames > 0 )
+	{
+		SDL_SetHint( SDL_HINT_VIDEODRIVER, "dummy" );
+		SDL_SetHint( SDL_HINT_RENDER_DRIVER, "software" );
+	}
+
 	//Initialize SDL
 	if( SDL_Init( SDL_INIT_VIDEO ) < 0 )
 	{
@@ -414,7 +4871,7 @@ bool init()
 		}
 
 		//Create window
-		gWindow = SDL_CreateWindow( "SDL Tutorial", SDL_WINDOWPOS_UNDEFINED, SDL_WINDOWPOS_UNDEFINED, SCREEN_WIDTH, SCREEN_HEIGHT, SDL_WINDOW_SHOWN );
+		gWindow = SDL_CreateWindow( "SDL Tutorial", SDL_WINDOWPOS_UNDEFINED, SDL_WINDOWPOS_UNDEFINED, SCREEN_WIDTH, SCREEN_HEIGHT, gOptions.benchFrames > 0 ? SDL_WINDOW_HIDDEN : SDL_WINDOW_SHOWN );
 		if( gWindow == NULL )
 		{
 			printf( "Window could not be created! SDL Error: %s\n", SDL_GetError() );
@@ -422,8 +4879,17 @@ bool init()
 		}
 		else
 		{
-			//Create vsynced renderer for window
-			gRenderer = SDL_CreateRenderer( gWindow, -1, SDL_RENDERER_ACCELERATED | SDL_RENDERER_PRESENTVSYNC );
+			//Create renderer for window, vsynced when pacing by vsync, or an unsynced software one for benchmarks
+			Uint32 rendererFlags = SDL_RENDERER_ACCELERATED;
+			if( gOptions.pacing == PACING_VSYNC )
+			{
+				rendererFlags |= SDL_RENDERER_PRESENTVSYNC;
+			}
+			if( gOptions.benchFrames > 0 )
+			{
+				rendererFlags = SDL_RENDERER_SOFTWARE;
+			}
+			gRenderer = SDL_CreateRenderer( gWindow, -1, rendererFlags );
 			if( gRenderer == NULL )
 			{
 				printf( "Renderer could not be created! SDL Error: %s\n", SDL_GetError() );
@@ -434,6 +4900,9 @@ bool init()
 				//Initialize renderer color
 				SDL_SetRenderDrawColor( gRenderer, 0xFF, 0xFF, 0xFF, 0xFF );
 
+				//Load images straight into the format the renderer keeps textures in
+				chooseTextureFormat();
+
 				//Initialize PNG loading
 				int imgFlags = IMG_INIT_PNG;
 				if( !( IMG_Init( imgFlags ) & imgFlags ) )
@@ -452,45 +4921,80 @@ bool loadMedia()
 	//Loading success flag
 	bool success = true;
 
-	//Load sprite texture
-	if( !gSpriteTexture.loadFromFile("shorted_sprite_sheet.png") )
+	//Serve images from the precompiled pack when there is one, decode the rest in parallel
+	gAssetPack.open( ASSET_PACK_PATH );
+	AssetLoader loader( &gAssetPack );
+	std::shared_future<SDL_Surface*> images[ IMAGE_ASSET_COUNT ];
+	for( int i = 0; i < IMAGE_ASSET_COUNT; ++i )
 	{
-		printf( "Failed to load sprite texture!\n" );
-		success = false;
+		images[ i ] = loader.load( IMAGE_ASSETS[ i ].path );
 	}
-	else
+
+	//Walking frames, the pack's metadata wins over the built in table
+	const ImageAsset& sheet = IMAGE_ASSETS[ IMAGE_SPRITE_SHEET ];
+	std::vector<SDL_Rect> walkClips = gAssetPack.getClips( sheet.path );
+	if( (int)walkClips.size() != WALKING_ANIMATION_FRAMES )
 	{
-		//Set Sprite clips
-		gspriteClip[ 0 ].x =   0;
-		gspriteClip[ 0 ].y =   0;
-		gspriteClip[ 0 ].w = 112;
-		gspriteClip[ 0 ].h = 166;
-
-		gspriteClip[ 1 ].x =  112;
-		gspriteClip[ 1 ].y =   0;
-		gspriteClip[ 1 ].w =  112;
-		gspriteClip[ 1 ].h = 166;
-		
-		gspriteClip[ 2 ].x = 224;
-		gspriteClip[ 2 ].y =   0;
-		gspriteClip[ 2 ].w = 112;
-		gspriteClip[ 2 ].h = 166;
+		walkClips.assign( sheet.clips, sheet.clips + sheet.clipCount );
+	}
 
-		gspriteClip[ 3 ].x = 336;
-		gspriteClip[ 3 ].y =   0;
-		gspriteClip[ 3 ].w = 112;
-		gspriteClip[ 3 ].h = 166;
+	//Share every decoded image by path as it finishes
+	ImageHandle decoded[ IMAGE_ASSET_COUNT ];
+	for( int i = 0; i < IMAGE_ASSET_COUNT; ++i )
+	{
+		decoded[ i ] = gTextureCache.acquireImage( IMAGE_ASSETS[ i ].path, images[ i ].get() );
 	}
 
-	//load animals
-	if( !gAnimalTexture.loadFromFile("animal.png") )
+	//Queue the sprite images for the atlas
+	if( !gSpriteAtlas.addFrames( "walk", decoded[ IMAGE_SPRITE_SHEET ], walkClips.data(), WALKING_ANIMATION_FRAMES ) )
 	{
 		printf( "Failed to load sprite texture!\n" );
 		success = false;
 	}
+	if( !gSpriteAtlas.addImage( "animal", decoded[ IMAGE_ANIMAL ] ) )
+	{
+		printf( "Failed to load animal texture!\n" );
+		success = false;
+	}
+	if( !gSpriteAtlas.addImage( "character", decoded[ IMAGE_CHARACTER ] ) )
+	{
+		printf( "Failed to load character texture!\n" );
+		success = false;
+	}
+	if( !gSpriteAtlas.addImage( "dust", gTextureCache.acquireImage( "generated:dust", normalizeSurface( createDustSurface() ) ) ) )
+	{
+		printf( "Failed to create dust texture!\n" );
+		success = false;
+	}
+
+	//Pack and upload the atlas
+	if( !gSpriteAtlas.build() )
+	{
+		printf( "Failed to build sprite atlas!\n" );
+		success = false;
+	}
+	else
+	{
+		//Set Sprite clips
+		for( int i = 0; i < WALKING_ANIMATION_FRAMES; ++i )
+		{
+			gSpriteFrames[ SPRITE_WALK ].push_back( gSpriteAtlas.getRegion( "walk", i ) );
+		}
+		gSpriteFrames[ SPRITE_ANIMAL ].push_back( gSpriteAtlas.getRegion( "animal" ) );
+		if( gSpriteFrames[ SPRITE_ANIMAL ][ 0 ] == NULL || gSpriteFrames[ SPRITE_WALK ][ 0 ] == NULL )
+		{
+			printf( "Sprite atlas is missing regions!\n" );
+			success = false;
+		}
+		else if( !gAnimations.load( "animations.txt" ) )
+		{
+			printf( "Failed to load animations!\n" );
+			success = false;
+		}
+	}
 
 	//Load background texture
-	if( !gBGTexture.loadFromFile( "photo.png" ) )
+	if( !gBackground.load( decoded[ IMAGE_BACKGROUND ] ) )
 	{
 		printf( "Failed to load background texture!\n" );
 		success = false;
@@ -499,12 +5003,110 @@ bool loadMedia()
 	return success;
 }
 
+bool writeAssetPack( std::string path )
+{
+	std::vector<std::string> names;
+	std::vector<SDL_Surface*> surfaces;
+	std::vector<std::vector<SDL_Rect>> clips;
+
+	//Run every image through the same decode path the game uses
+	bool success = true;
+	for( int i = 0; i < IMAGE_ASSET_COUNT; ++i )
+	{
+		SDL_Surface* surface = loadSurface( IMAGE_ASSETS[ i ].path );
+		if( surface == NULL )
+		{
+			success = false;
+			continue;
+		}
+		names.push_back( IMAGE_ASSETS[ i ].path );
+		surfaces.push_back( surface );
+		clips.push_back( std::vector<SDL_Rect>( IMAGE_ASSETS[ i ].clips, IMAGE_ASSETS[ i ].clips + IMAGE_ASSETS[ i ].clipCount ) );
+	}
+
+	if( success )
+	{
+		success = AssetPack::write( path, names, surfaces, clips );
+	}
+
+	for( int i = 0; i < (int)surfaces.size(); ++i )
+	{
+		SDL_FreeSurface( surfaces[ i ] );
+	}
+	return success;
+}
+
+void printUsage()
+{
+	printf( "Usage: a.out [options]\n" );
+	printf( "  --help                  print these options\n" );
+	printf( "  --pack <path>           decode every image into an asset pack at path and exit\n" );
+	printf( "  --selftest              check the vector movement kernels against the scalar one and exit\n" );
+	printf( "  --animals <count>       animals in the herd, default 3\n" );
+	printf( "  --bench <frames>        run headless for frames and print a JSON report\n" );
+	printf( "  --threads <count>       simulation job threads, 0 for one per core\n" );
+	printf( "  --dust <rate>           dust particles per second while walking\n" );
+	printf( "  --scroll <speed>        backdrop scroll in pixels per tick, 0 holds it still\n" );
+	printf( "  --tick-rate <rate>      simulation ticks per second, 1 to 1000\n" );
+	printf( "  --pacing <policy>       vsync, uncapped, or a frame rate from 1 to 1000\n" );
+	printf( "  --idle-skip             skip drawing frames that would look like the one on screen\n" );
+	printf( "  --premultiply           premultiply texture alpha at load time\n" );
+	printf( "  --texture-storage <s>   auto stores textures in 16 bits where the content allows, full keeps 32 bits\n" );
+	printf( "                          auto only saves memory on renderers that sample RGB565 or RGBA4444 natively,\n" );
+	printf( "                          SDL's opengl, opengles2, direct3d11 and metal renderers do not, so it saves nothing there\n" );
+	printf( "  --record <path>         record keyboard input to path\n" );
+	printf( "  --replay <path>         play keyboard input back from path\n" );
+}
+
+bool parseRate( const char* text, int& rate )
+{
+	//Higher rates would round the performance counter's period down to nothing
+	char* end = NULL;
+	long value = strtol( text, &end, 10 );
+	if( end == text || *end != '\0' || value < 1 || value > 1000 )
+	{
+		return false;
+	}
+	rate = (int)value;
+	return true;
+}
+
+void printBenchReport( std::vector<double>& frameTimes, double seconds, RenderList& lastFrame )
+{
+	int entityCount = lastFrame.entityCount;
+	//Percentiles over the sorted frame times
+	std::vector<double> sorted( frameTimes );
+	std::sort( sorted.begin(), sorted.end() );
+	double total = 0;
+	for( int i = 0; i < (int)sorted.size(); ++i )
+	{
+		total += sorted[ i ];
+	}
+	auto percentile = [ &sorted ]( double p ) { return sorted[ std::min( sorted.size() - 1, (size_t)( p * sorted.size() ) ) ]; };
+
+	//Peak resident set size, reported in kilobytes on Linux
+	struct rusage usage;
+	getrusage( RUSAGE_SELF, &usage );
+
+	SDL_RendererInfo info;
+	SDL_GetRendererInfo( gRenderer, &info );
+
+	printf( "{\"frames\":%d,\"entities\":%d,\"visible\":%d,\"particles\":%d,\"renderer\":\"%s\",\"seconds\":%.6f,", (int)sorted.size(), entityCount, lastFrame.cullStats.visible, (int)lastFrame.particles.size(), info.name, seconds );
+	printf( "\"frame_ms\":{\"min\":%.4f,\"avg\":%.4f,\"p50\":%.4f,\"p90\":%.4f,\"p99\":%.4f,\"max\":%.4f},", sorted.front(), total / sorted.size(), percentile( 0.5 ), percentile( 0.9 ), percentile( 0.99 ), sorted.back() );
+	printf( "\"entities_per_second\":%.1f,\"peak_rss_kb\":%ld,", seconds > 0 ? entityCount * sorted.size() / seconds : 0.0, (long)usage.ru_maxrss );
+	printf( "\"frame_arena_peak_kb\":%ld,\"tick_arena_peak_kb\":%ld,", (long)( lastFrame.arena.getHighWater() / 1024 ), (long)( lastFrame.tickArenaPeak / 1024 ) );
+	printf( "\"texture_format\":\"%s\",\"conversions\":%d,\"conversion_ms\":%.3f,\"slow_uploads\":%d,", SDL_GetPixelFormatName( gTextureFormat ), (int)gTextureStats.conversions, gTextureStats.conversionTicks * 1000.0 / SDL_GetPerformanceFrequency(), (int)gTextureStats.slowUploads );
+	printf( "\"texture_kb\":%ld,\"texture_saved_kb\":%ld,\"compact_storage\":\"%s\"}\n", (long)( gTextureStats.storedBytes / 1024 ), (long)( ( gTextureStats.fullBytes - gTextureStats.storedBytes ) / 1024 ), getCompactStorageState() );
+	fflush( stdout );
+}
+
 void close()
 {
 	//Free loaded images
-	gSpriteTexture.free();
-	gBGTexture.free();
-	gAnimalTexture.free();
+	gBackgroundLayer.free();
+	gBackground.free();
+	gSpriteAtlas.free();
+	gAssetPack.close();
 	//Destroy window	
 	SDL_DestroyRenderer( gRenderer );
 	SDL_DestroyWindow( gWindow );
@@ -518,6 +5120,128 @@ void close()
 
 int main( int argc, char* args[] )
 {
+	//Build the asset pack instead of running the game
+	if( argc == 3 && strcmp( args[ 1 ], "--pack" ) == 0 )
+	{
+		IMG_Init( IMG_INIT_PNG );
+		bool packed = writeAssetPack( args[ 2 ] );
+		IMG_Quit();
+		return packed ? 0 : 1;
+	}
+
+	//Check the vector kernels against the scalar ones instead of running the game
+	if( argc == 2 && strcmp( args[ 1 ], "--selftest" ) == 0 )
+	{
+		return testMoveAxisKernels() ? 0 : 1;
+	}
+
+	//List the options instead of running the game
+	if( argc == 2 && strcmp( args[ 1 ], "--help" ) == 0 )
+	{
+		printUsage();
+		return 0;
+	}
+
+	//Read options
+	bool optionsValid = true;
+	for( int i = 1; i < argc; ++i )
+	{
+		if( strcmp( args[ i ], "--animals" ) == 0 && i + 1 < argc )
+		{
+			gOptions.herdSize = std::max( 0, atoi( args[ ++i ] ) );
+		}
+		else if( strcmp( args[ i ], "--bench" ) == 0 && i + 1 < argc )
+		{
+			gOptions.benchFrames = std::max( 0, atoi( args[ ++i ] ) );
+		}
+		else if( strcmp( args[ i ], "--threads" ) == 0 && i + 1 < argc )
+		{
+			gOptions.threadCount = std::max( 0, atoi( args[ ++i ] ) );
+		}
+		else if( strcmp( args[ i ], "--dust" ) == 0 && i + 1 < argc )
+		{
+			gOptions.dustRate = std::max( 0.f, (float)atof( args[ ++i ] ) );
+		}
+		else if( strcmp( args[ i ], "--scroll" ) == 0 && i + 1 < argc )
+		{
+			gOptions.scrollSpeed = std::max( 0.f, (float)atof( args[ ++i ] ) );
+		}
+		else if( strcmp( args[ i ], "--idle-skip" ) == 0 )
+		{
+			gOptions.idleSkip = true;
+		}
+		else if( strcmp( args[ i ], "--premultiply" ) == 0 )
+		{
+			gOptions.premultiplied = true;
+		}
+		else if( strcmp( args[ i ], "--texture-storage" ) == 0 && i + 1 < argc )
+		{
+			//auto picks 16 bit formats where the content allows, full keeps everything at 32 bits
+			++i;
+			if( strcmp( args[ i ], "auto" ) == 0 )
+			{
+				gOptions.compactTextures = true;
+			}
+			else if( strcmp( args[ i ], "full" ) == 0 )
+			{
+				gOptions.compactTextures = false;
+			}
+			else
+			{
+				printf( "Invalid --texture-storage value \"%s\"! Expected auto or full\n", args[ i ] );
+				optionsValid = false;
+			}
+		}
+		else if( strcmp( args[ i ], "--tick-rate" ) == 0 && i + 1 < argc )
+		{
+			++i;
+			if( !parseRate( args[ i ], gOptions.tickRate ) )
+			{
+				printf( "Invalid --tick-rate value \"%s\"! Expected a tick rate from 1 to 1000\n", args[ i ] );
+				optionsValid = false;
+			}
+		}
+		else if( strcmp( args[ i ], "--pacing" ) == 0 && i + 1 < argc )
+		{
+			//vsync, uncapped, or a frame rate to cap at
+			++i;
+			if( strcmp( args[ i ], "vsync" ) == 0 )
+			{
+				gOptions.pacing = PACING_VSYNC;
+			}
+			else if( strcmp( args[ i ], "uncapped" ) == 0 )
+			{
+				gOptions.pacing = PACING_UNCAPPED;
+			}
+			else
+			{
+				//A cap has to be a whole, positive rate
+				if( !parseRate( args[ i ], gOptions.targetFps ) )
+				{
+					printf( "Invalid --pacing value \"%s\"! Expected vsync, uncapped, or a frame rate from 1 to 1000\n", args[ i ] );
+					optionsValid = false;
+				}
+				else
+				{
+					gOptions.pacing = PACING_CAPPED;
+				}
+			}
+		}
+		else if( strcmp( args[ i ], "--record" ) == 0 && i + 1 < argc )
+		{
+			gOptions.recordPath = args[ ++i ];
+		}
+		else if( strcmp( args[ i ], "--replay" ) == 0 && i + 1 < argc )
+		{
+			gOptions.replayPath = args[ ++i ];
+		}
+	}
+	if( !optionsValid )
+	{
+		printf( "Run with --help to list the options\n" );
+		return 1;
+	}
+
 	//Start up SDL and create window
 	if( !init() )
 	{
@@ -532,81 +5256,402 @@ int main( int argc, char* args[] )
 		}
 		else
 		{	
-			//Main loop flag
-			bool quit = false;
+			//Main loop flag, the simulation thread sets it too when a replay ends
+			std::atomic<bool> quit( false );
 
 			//Event handler
 			SDL_Event e;
 
+			//Threads the simulation passes run on
+			JobSystem jobs( gOptions.threadCount );
+
+			//Every simulated object
+			EntityStore entities;
+
 			//The sprite that will be moving around on the screen
-			Sprite sprite;
+			Sprite sprite( entities, 0, 579 );
+
+
+			//animals
+			spawnHerd( entities, gOptions.herdSize );
+
+			//Dust kicked up by the walking sprite
+			ParticleSystem particles( gSpriteAtlas.getRegion( "dust" ) );
+			ParticleEmitter dust;
+			dust.entity = sprite.getEntity();
+			dust.rate = gOptions.dustRate;
+			dust.movingOnly = true;
+			dust.speed = 120;
+			dust.spread = 60;
+			dust.life = 0.8f;
+			dust.color = { 0xA0, 0x80, 0x60, 0xC0 };
+			particles.addEmitter( dust );
+
+			//Broadphase, and the arena the contacts it finds each tick live in
+			SpatialHash grid;
+			FrameArena tickArena;
+			{
+				FrameVector<std::pair<int, int>> contacts{ FrameAllocator<std::pair<int, int>>( &tickArena ) };
+				updateContacts( entities, grid, contacts );
+			}
+
+			//The part of the world on screen
+			SDL_Rect camera = { 0, 0, SCREEN_WIDTH, SCREEN_HEIGHT };
+
+			//When the window title last showed the cull counts
+			Uint32 lastStatsTime = 0;
+
+			//Wall time of every benchmark frame
+			std::vector<double> benchFrameTimes;
+			benchFrameTimes.reserve( gOptions.benchFrames );
+			Uint64 benchStart = SDL_GetPerformanceCounter();
+			Uint64 benchFrameStart = benchStart;
+			//The background scrolling offset now and before the last tick
+			float scrollingOffset = 0;
+			float previousScrollingOffset = 0;
+
+			//Simulation ticks run so far, input is stamped with the tick it lands before
+			Uint32 simTick = 0;
+
+			//Open the input recording
+			InputLog inputLog;
+			if( !gOptions.replayPath.empty() && !inputLog.replay( gOptions.replayPath ) )
+			{
+				quit = true;
+			}
+			else if( !gOptions.recordPath.empty() && !inputLog.record( gOptions.recordPath ) )
+			{
+				quit = true;
+			}
+
+			//Key events waiting for the simulation thread
+			std::vector<SDL_Event> pendingInput;
+			std::mutex inputMutex;
+
+			//Frames handed from the simulation thread to this one
+			RenderListBuffer renderLists;
+
+			//Lists published and drawn, benchmarks keep them in lockstep
+			Uint32 published = 0;
+			std::atomic<Uint32> framesDrawn( 0 );
+
+			//Pushed by the simulation to wake the main thread when the screen stops being idle
+			Uint32 wakeEvent = SDL_RegisterEvents( 1 );
+
+			//Steps the simulation as real time passes and publishes a render list after each catch up, so a slow present never holds up a tick
+			std::thread simulation( [ & ]()
+			{
+				//Length of one simulation tick in performance counter units
+				const Uint64 tickLength = SDL_GetPerformanceFrequency() / gOptions.tickRate;
+
+				//Time that has passed but not yet been simulated
+				Uint64 accumulator = 0;
+				Uint64 previousTime = SDL_GetPerformanceCounter();
+
+				//What was last published, to tell idle frames apart
+				DamageTracker damage;
+				Uint32 changedTick = 0;
+				bool quiet = false;
+
+				std::vector<SDL_Event> input;
+				while( !quit )
+				{
+					//Benchmarks wait for each tick to be drawn so every frame shows exactly one
+					if( gOptions.benchFrames > 0 && framesDrawn < published )
+					{
+						std::this_thread::yield();
+						continue;
+					}
+
+					//Handle input for the sprite
+					{
+						std::lock_guard<std::mutex> lock( inputMutex );
+						input.swap( pendingInput );
+					}
+					for( int i = 0; i < (int)input.size(); ++i )
+					{
+						inputLog.write( input[ i ], simTick );
+						sprite.handleEvent( input[ i ] );
+					}
+					input.clear();
+
+					//Accumulate elapsed real time, benchmarks run exactly one tick per frame so every run does the same work
+					Uint64 currentTime = SDL_GetPerformanceCounter();
+					accumulator += gOptions.benchFrames > 0 ? tickLength : currentTime - previousTime;
+					previousTime = currentTime;
+
+					//Run the simulation in fixed steps until it has caught up
+					int ticks = 0;
+					while( accumulator >= tickLength && ticks < MAX_TICKS_PER_FRAME && !quit )
+					{
+						PROFILE_SCOPE( "tick" );
+
+						//Play back input due before this tick
+						SDL_Event recorded;
+						while( inputLog.next( simTick, recorded ) )
+						{
+							if( recorded.type == SDL_QUIT )
+							{
+								quit = true;
+							}
+							sprite.handleEvent( recorded );
+						}
+						if( quit )
+						{
+							break;
+						}
+
+						//Last tick's transient data goes all at once
+						tickArena.reset();
+						FrameVector<std::pair<int, int>> contacts{ FrameAllocator<std::pair<int, int>>( &tickArena ) };
+
+						//Movement, particles and animation touch separate columns so they run side by side, contacts and emitters need the moved positions
+						int count = entities.getCount();
+						float seconds = 1.f / gOptions.tickRate;
+						auto move = [ & ]( int begin, int end )
+						{
+							PROFILE_SCOPE( "move" );
+							moveEntities( entities, begin, end );
+						};
+						auto integrate = [ & ]( int begin, int end )
+						{
+							PROFILE_SCOPE( "particles-integrate" );
+							particles.integrate( begin, end, seconds );
+						};
+						auto animate = [ & ]( int begin, int end )
+						{
+							PROFILE_SCOPE( "animate" );
+							gAnimations.advance( entities, seconds, begin, end );
+						};
+						auto touch = [ & ]()
+						{
+							PROFILE_SCOPE( "contacts" );
+							updateContacts( entities, grid, contacts );
+						};
+						auto spray = [ & ]()
+						{
+							PROFILE_SCOPE( "emit" );
+							particles.update( entities, seconds );
+						};
+						JobCounter moved, animated, touched, sprayed;
+						jobs.parallelFor( count, ENTITY_JOB_GRAIN, move, &moved );
+						jobs.parallelFor( particles.getCount(), PARTICLE_JOB_GRAIN, integrate, &moved );
+						jobs.parallelFor( count, ENTITY_JOB_GRAIN, animate, &animated );
+						jobs.run( touch, &touched, &moved );
+						jobs.run( spray, &sprayed, &moved );
+
+						//Scroll background, wrapping both offsets so the blend between them stays short
+						previousScrollingOffset = scrollingOffset;
+						scrollingOffset -= gOptions.scrollSpeed * tickScale();
+						if( scrollingOffset < -gBackground.getWidth() )
+						{
+							scrollingOffset += gBackground.getWidth();
+							previousScrollingOffset += gBackground.getWidth();
+						}
+
+						jobs.wait( &animated );
+						jobs.wait( &touched );
+						jobs.wait( &sprayed );
+
+						accumulator -= tickLength;
+						++ticks;
+						++simTick;
+					}
+
+					//Drop time we could not catch up on instead of spiralling
+					if( accumulator >= tickLength )
+					{
+						accumulator %= tickLength;
+					}
 
-			//Current animation frame
-			int frame = 0;
+					//Cull and hand the new state to the main thread
+					if( ( ticks > 0 || published == 0 ) && !quit )
+					{
+						PROFILE_SCOPE( "publish" );
+						RenderList& list = renderLists.getWriteList();
+						list.clear();
+						FrameVector<int> visible( FrameAllocator<int>( &list.arena ) );
+						list.cullStats = cullEntities( entities, grid, camera, visible, jobs );
+						renderEntities( entities, visible, camera, list );
+						particles.render( camera, list );
+						list.scrollingOffset = scrollingOffset;
+						list.previousScrollingOffset = previousScrollingOffset;
+						list.view = camera;
+						list.tick = simTick;
+						list.tickTime = currentTime - accumulator;
+						list.tickLength = tickLength;
+						list.entityCount = entities.getCount();
+						list.tickArenaPeak = tickArena.getHighWater();
+
+						//Idle frames are only worth spotting when they get skipped
+						if( !gOptions.idleSkip || damage.update( list ) )
+						{
+							changedTick = simTick;
+						}
+						list.changedTick = changedTick;
+						list.moving = !gOptions.idleSkip || DamageTracker::isMoving( list );
+						renderLists.publish();
+						++published;
+
+						//The main thread may be asleep on an unchanged screen, wake it as soon as there is something new
+						bool changed = changedTick == simTick || list.moving;
+						if( gOptions.idleSkip && changed && quiet && wakeEvent != (Uint32)-1 )
+						{
+							SDL_Event wake;
+							SDL_zero( wake );
+							wake.type = wakeEvent;
+							SDL_PushEvent( &wake );
+						}
+						quiet = !changed;
+					}
+
+					//Sleep until the next tick is due
+					if( gOptions.benchFrames == 0 && accumulator < tickLength )
+					{
+						std::this_thread::sleep_for( std::chrono::nanoseconds( ( tickLength - accumulator ) * 1000000000 / SDL_GetPerformanceFrequency() ) );
+					}
+				}
+			} );
 
-			//animal
-			Animal animal;
-			//The background scrolling offset
-			int scrollingOffset = 0;
+			//Whether a list has arrived yet
+			bool hasList = false;
+
+			//Times presents, benchmarks never wait
+			FramePacer pacer;
+			pacer.setPolicy( gOptions.benchFrames > 0 ? PACING_UNCAPPED : gOptions.pacing, gOptions.targetFps );
+
+			//Change the screen last showed, whether it has to be drawn regardless and whether the last frame was skipped
+			Uint32 drawnChange = 0;
+			bool redraw = true;
+			bool idle = false;
 
 			//While application is running
 			while( !quit )
 			{
-				//Handle events on queue
-				while( SDL_PollEvent( &e ) != 0 )
+				//Handle events on queue, sleeping until one arrives while the screen is idle
 				{
+				PROFILE_SCOPE( "events" );
+				bool waited = idle && SDL_WaitEventTimeout( &e, IDLE_WAIT_MS ) != 0;
+				while( waited || SDL_PollEvent( &e ) != 0 )
+				{
+					waited = false;
+
 					//User requests quit
 					if( e.type == SDL_QUIT )
 					{
 						quit = true;
 					}
 
-					//Handle input for the sprite
-					sprite.handleEvent( e );
-                    
-				}				
+					//Dump the profiler on demand
+					if( e.type == SDL_KEYDOWN && e.key.repeat == 0 && e.key.keysym.sym == SDLK_F12 )
+					{
+						Profiler::printSummary();
+						printf( "Textures: %d cached, %d decoded images, %ld KB, %ld KB saved by compact storage (%s)\n", gTextureCache.getResidentCount(), gTextureCache.getImageCount(), (long)( gTextureStats.storedBytes / 1024 ), (long)( ( gTextureStats.fullBytes - gTextureStats.storedBytes ) / 1024 ), getCompactStorageState() );
+						Profiler::writeTrace( "trace.json" );
+					}
+
+					//Some renderers drop target texture contents, cached layers have to be drawn again
+					if( e.type == SDL_RENDER_TARGETS_RESET || e.type == SDL_RENDER_DEVICE_RESET )
+					{
+						gBackgroundLayer.invalidate();
+						redraw = true;
+					}
+
+					//The window may have been uncovered or resized
+					if( e.type == SDL_WINDOWEVENT )
+					{
+						redraw = true;
+					}
+
+					//Pass keys on to the simulation unless a recording drives it
+					if( ( e.type == SDL_KEYDOWN || e.type == SDL_KEYUP ) && !inputLog.isReplaying() )
+					{
+						std::lock_guard<std::mutex> lock( inputMutex );
+						pendingInput.push_back( e );
+					}
+				}
+				}
 
-				sprite.move();
-				
+				//Take the newest state the simulation finished, benchmarks only draw new ticks
+				bool fresh = renderLists.acquire();
+				hasList = hasList || fresh;
+				if( gOptions.benchFrames > 0 && !fresh )
+				{
+					std::this_thread::yield();
+					continue;
+				}
 
-				//Scroll background
-				scrollingOffset -= 2;
-				if( scrollingOffset < -gBGTexture.getWidth() )
+				//Skip frames that would look exactly like the one on screen
+				RenderList& list = renderLists.getReadList();
+				idle = gOptions.idleSkip && gOptions.benchFrames == 0 && hasList && !redraw && !list.moving && list.changedTick == drawnChange;
+				if( idle )
 				{
-					scrollingOffset = 0;
+					continue;
 				}
+				redraw = !hasList;
+				drawnChange = list.changedTick;
+
+				PROFILE_SCOPE( "frame" );
 
 				//Clear screen
 				SDL_SetRenderDrawColor( gRenderer, 0xFF, 0xFF, 0xFF, 0xFF );
 				SDL_RenderClear( gRenderer );
 
-				//Render background
-				gBGTexture.render( scrollingOffset, 0, 0, SDL_FLIP_NONE );
-				gBGTexture.render( scrollingOffset + gBGTexture.getWidth(), 0, 0, SDL_FLIP_NONE );
-
-				//Render objects
-				//Render current frame
-				SDL_Rect* currentClip = &gspriteClip[ frame / 4 ];
-				gSpriteTexture.RenderSprite( ( SCREEN_WIDTH - currentClip->w ) / 2, ( SCREEN_HEIGHT - currentClip->h ) / 3, currentClip  );
-		
-				//Go to next frame
-				++frame;				
-				
-				//Cycle animation
-				if( frame / 4 >= WALKING_ANIMATION_FRAMES )
+				//Render background and objects inside the view
+				if( hasList )
 				{
-					frame = 0;
-				}		
-				
+					//Draw one tick behind, blending towards the newest state as its tick time passes; benchmarks draw the newest state
+					float alpha = 1;
+					Uint64 now = SDL_GetPerformanceCounter();
+					if( gOptions.benchFrames == 0 )
+					{
+						alpha = now > list.tickTime ? std::min( 1.f, (float)( now - list.tickTime ) / list.tickLength ) : 0.f;
+					}
+					drawRenderList( list, alpha );
+				}
 
-				//render animals
-				animal.render();
+				//Show the cull counts and frame pacing once a second
+				if( hasList && SDL_GetTicks() - lastStatsTime >= 1000 )
+				{
+					lastStatsTime = SDL_GetTicks();
+					char title[ 192 ];
+					snprintf( title, sizeof( title ), "SDL Tutorial - visible %d, culled %d, tiles %d, frame %.2f ms +/- %.2f, worst %.2f", list.cullStats.visible, list.cullStats.culled, gBackground.getResidentCount(), pacer.getMeanInterval(), pacer.getJitter(), pacer.getWorstInterval() );
+					pacer.resetStats();
+					SDL_SetWindowTitle( gWindow, title );
+				}
 
-				//Update screen
+				//Update screen when the pacing policy says the frame is due
+				{
+				PROFILE_SCOPE( "pace" );
+				pacer.wait();
+				}
+				{
+				PROFILE_SCOPE( "present" );
 				SDL_RenderPresent( gRenderer );
+				}
+				pacer.presented();
+				if( fresh )
+				{
+					++framesDrawn;
+				}
 
-				SDL_Delay(15);
+				//Stop after the benchmark's frames
+				if( gOptions.benchFrames > 0 )
+				{
+					Uint64 frameEnd = SDL_GetPerformanceCounter();
+					benchFrameTimes.push_back( ( frameEnd - benchFrameStart ) * 1000.0 / SDL_GetPerformanceFrequency() );
+					benchFrameStart = frameEnd;
+					if( (int)benchFrameTimes.size() >= gOptions.benchFrames )
+					{
+						printBenchReport( benchFrameTimes, ( frameEnd - benchStart ) / (double)SDL_GetPerformanceFrequency(), list );
+						quit = true;
+					}
+				}
 			}
+			simulation.join();
+
+			//Mark where the recording stops
+			inputLog.close( simTick );
 		}
 	}
 	//Free resources and close SDL
@@ -11,6 +11,12 @@ using namespace std;
 const int SCREEN_WIDTH = 1578;
 const int SCREEN_HEIGHT = 878;
 
+//Simulation tick rate, independent of the display refresh rate
+const int TICKS_PER_SECOND = 60;
+
+//Most ticks we will catch up on before rendering a frame
+const int MAX_TICKS_PER_FRAME = 5;
+
 //Texture wrapper class
 class LTexture
 {
@@ -98,14 +104,27 @@ class Animal
 		//Initializes the variables
 		Animal();
 
-		//Shows the dot on the screen
+		//Shows the visible animals on the screen
 		void render();
-        void viewport();
+
+		//Tests each animal against the view, only those inside it get rendered
+		void viewport( SDL_Rect& view );
+
+		//Gets how many animals the last viewport pass kept and dropped
+		int getVisibleCount();
+		int getCulledCount();
 
     private:
 		//The X and Y offsets of the dot
 		int posAx1, posAx2, posAx3, posAy1, posAy2, posAy3;
 
+		//The view the animals were last tested against
+		SDL_Rect mView;
+
+		//Which animals overlap the view
+		bool mVisible[ 3 ];
+		int mVisibleCount;
+
 		//The velocity of the dot
 		int mVelX, mVelY;
 };
@@ -125,6 +144,9 @@ SDL_Window* gWindow = NULL;
 //The window renderer
 SDL_Renderer* gRenderer = NULL;
 
+//Format textures are created in, the renderer's preferred one once it exists
+Uint32 gTextureFormat = SDL_PIXELFORMAT_ARGB8888;
+
 //Scene textures
 LTexture gDotTexture;
 LTexture gBGTexture;
@@ -163,8 +185,26 @@ bool LTexture::loadFromFile( std::string path )
 		//Color key image
 		SDL_SetColorKey( loadedSurface, SDL_TRUE, SDL_MapRGB( loadedSurface->format, 0, 0xFF, 0xFF ) );
 
-		//Create texture from surface pixels
-        newTexture = SDL_CreateTextureFromSurface( gRenderer, loadedSurface );
+		//Convert once into the texture format, which turns keyed pixels transparent
+		SDL_Surface* convertedSurface = SDL_ConvertSurfaceFormat( loadedSurface, gTextureFormat, 0 );
+		if( convertedSurface == NULL )
+		{
+			printf( "Unable to convert image %s! SDL Error: %s\n", path.c_str(), SDL_GetError() );
+		}
+		else
+		{
+			//The key is in the alpha now, left set it would make SDL convert the surface again on upload
+			SDL_SetColorKey( convertedSurface, SDL_FALSE, 0 );
+
+			//Create texture from surface pixels, copied up as they are
+			newTexture = SDL_CreateTexture( gRenderer, gTextureFormat, SDL_TEXTUREACCESS_STATIC, convertedSurface->w, convertedSurface->h );
+			if( newTexture != NULL )
+			{
+				SDL_UpdateTexture( newTexture, NULL, convertedSurface->pixels, convertedSurface->pitch );
+				SDL_SetTextureBlendMode( newTexture, SDL_BLENDMODE_BLEND );
+			}
+			SDL_FreeSurface( convertedSurface );
+		}
 		if( newTexture == NULL )
 		{
 			printf( "Unable to create texture from %s! SDL Error: %s\n", path.c_str(), SDL_GetError() );
@@ -367,14 +407,60 @@ Animal::Animal()
     posAy1 = 685;
     posAy2 = 685;
     posAy3 = 685;
+
+    //Everything is visible until the first viewport pass
+    mView.x = 0;
+    mView.y = 0;
+    mView.w = SCREEN_WIDTH;
+    mView.h = SCREEN_HEIGHT;
+    mVisible[ 0 ] = mVisible[ 1 ] = mVisible[ 2 ] = true;
+    mVisibleCount = 3;
+}
+
+void Animal::viewport( SDL_Rect& view )
+{
+	mView = view;
+
+	//Test each animal's bounds against the view
+	int xs[ 3 ] = { posAx1, posAx2, posAx3 };
+	int ys[ 3 ] = { posAy1, posAy2, posAy3 };
+	mVisibleCount = 0;
+	for( int i = 0; i < 3; ++i )
+	{
+		SDL_Rect bounds = { xs[ i ], ys[ i ], gAnimalTexture.getWidth(), gAnimalTexture.getHeight() };
+		mVisible[ i ] = SDL_HasIntersection( &bounds, &view ) == SDL_TRUE;
+		if( mVisible[ i ] )
+		{
+			++mVisibleCount;
+		}
+	}
+}
+
+int Animal::getVisibleCount()
+{
+	return mVisibleCount;
+}
+
+int Animal::getCulledCount()
+{
+	return 3 - mVisibleCount;
 }
 
 void Animal::render()
 {
-	//Show the animal
-	gAnimalTexture.render( posAx1, posAy1, 0, SDL_FLIP_NONE );
-    gAnimalTexture.render( posAx2, posAy2, 0, SDL_FLIP_NONE );
-    gAnimalTexture.render( posAx3, posAy3, 0, SDL_FLIP_NONE );
+	//Show the animals inside the view
+	if( mVisible[ 0 ] )
+	{
+		gAnimalTexture.render( posAx1 - mView.x, posAy1 - mView.y, 0, SDL_FLIP_NONE );
+	}
+	if( mVisible[ 1 ] )
+	{
+		gAnimalTexture.render( posAx2 - mView.x, posAy2 - mView.y, 0, SDL_FLIP_NONE );
+	}
+	if( mVisible[ 2 ] )
+	{
+		gAnimalTexture.render( posAx3 - mView.x, posAy3 - mView.y, 0, SDL_FLIP_NONE );
+	}
 }
 
 bool init()
@@ -417,6 +503,21 @@ bool init()
 				//Initialize renderer color
 				SDL_SetRenderDrawColor( gRenderer, 0xFF, 0xFF, 0xFF, 0xFF );
 
+				//Load images straight into the first 32 bit format with alpha the renderer takes natively
+				SDL_RendererInfo info;
+				if( SDL_GetRendererInfo( gRenderer, &info ) == 0 )
+				{
+					for( Uint32 i = 0; i < info.num_texture_formats; ++i )
+					{
+						Uint32 format = info.texture_formats[ i ];
+						if( !SDL_ISPIXELFORMAT_FOURCC( format ) && SDL_BITSPERPIXEL( format ) == 32 && SDL_ISPIXELFORMAT_ALPHA( format ) )
+						{
+							gTextureFormat = format;
+							break;
+						}
+					}
+				}
+
 				//Initialize PNG loading
 				int imgFlags = IMG_INIT_PNG;
 				if( !( IMG_Init( imgFlags ) & imgFlags ) )
@@ -503,9 +604,20 @@ int main( int argc, char* args[] )
 
 			//animal
 			Animal animal;
+
+			//The part of the world on screen
+			SDL_Rect camera = { 0, 0, SCREEN_WIDTH, SCREEN_HEIGHT };
+
 			//The background scrolling offset
 			int scrollingOffset = 0;
 
+			//Length of one simulation tick in performance counter units
+			const Uint64 tickLength = SDL_GetPerformanceFrequency() / TICKS_PER_SECOND;
+
+			//Time that has passed but not yet been simulated
+			Uint64 accumulator = 0;
+			Uint64 previousTime = SDL_GetPerformanceCounter();
+
 			//While application is running
 			while( !quit )
 			{
@@ -523,14 +635,33 @@ int main( int argc, char* args[] )
                     
 				}
 
-				//Move the dot
-				dot.move();
+				//Accumulate elapsed real time
+				Uint64 currentTime = SDL_GetPerformanceCounter();
+				accumulator += currentTime - previousTime;
+				previousTime = currentTime;
+
+				//Run the simulation in fixed steps until it has caught up
+				int ticks = 0;
+				while( accumulator >= tickLength && ticks < MAX_TICKS_PER_FRAME )
+				{
+					//Move the dot
+					dot.move();
+
+					//Scroll background
+					--scrollingOffset;
+					if( scrollingOffset < -gBGTexture.getWidth() )
+					{
+						scrollingOffset = 0;
+					}
+
+					accumulator -= tickLength;
+					++ticks;
+				}
 
-				//Scroll background
-				--scrollingOffset;
-				if( scrollingOffset < -gBGTexture.getWidth() )
+				//Drop time we could not catch up on instead of spiralling
+				if( accumulator >= tickLength )
 				{
-					scrollingOffset = 0;
+					accumulator %= tickLength;
 				}
 
 				//Clear screen
@@ -544,7 +675,8 @@ int main( int argc, char* args[] )
 				//Render objects
 				dot.render();
 
-				//render animals
+				//render animals inside the view
+				animal.viewport( camera );
 				animal.render();
 
 				//Update screen